@@ -6,6 +6,17 @@
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+// sort_array_parallel uses POSIX threads. Define CARRAY_NO_THREADS to build without
+// them (it is set automatically for MSVC); sort_array_parallel then sorts serially.
+#if defined(_MSC_VER) && !defined(CARRAY_NO_THREADS)
+#define CARRAY_NO_THREADS
+#endif
+#ifndef CARRAY_NO_THREADS
+#include <pthread.h>
+#endif
+#include "crand.h"
 
 typedef enum{
     TYPE_INT,
@@ -17,15 +28,35 @@ typedef enum{
 
 typedef struct Array{
     int size;
+    int capacity;
     type_t type;
     void *data;
 } array;
 
+// Element comparisons shared by the typed kernels below
+#define CARRAY_LESS_NUM(a, b) ((a) < (b))
+#define CARRAY_EQ_NUM(a, b)   ((a) == (b))
+#define CARRAY_LESS_STR(a, b) (strcmp((a), (b)) < 0)
+#define CARRAY_EQ_STR(a, b)   (strcmp((a), (b)) == 0)
+
+// This function returns the size in bytes of one element of the given type
+size_t array_element_size(type_t type){
+    switch(type){
+        case TYPE_INT:    return sizeof(int);
+        case TYPE_FLOAT:  return sizeof(float);
+        case TYPE_DOUBLE: return sizeof(double);
+        case TYPE_CHAR:   return sizeof(char);
+        case TYPE_STRING: return sizeof(char*);
+    }
+    return 0;
+}
+
 /* Basic Array Ops */
 // This function creates an array of given size and type
 array* create_array(int size, type_t type){
     array *arr = (array*)malloc(sizeof(array));
     arr->size = size;
+    arr->capacity = size;
     arr->type = type;
     switch(type){
         case TYPE_INT:
@@ -73,38 +104,45 @@ void fill_array(array *arr, ...){
     va_end(valist);
 }
 
-// This function creates and returns an array filled with random values
-array* create_filled_array(int size, type_t type){
-    srand(time(NULL));
+// This function creates and returns an array filled with random values drawn from r
+// (NULL uses the calling thread's generator, see crand.h)
+array* create_filled_array_rng(int size, type_t type, rng *r){
+    if (r == NULL) r = rng_thread();
     array *arr = create_array(size, type);
-    for(int i = 0; i < size; i++){
-        switch(type){
-            case TYPE_INT:
-                ((int*)arr->data)[i] = rand() % 100;
-                break;
-            case TYPE_FLOAT:
-                ((float*)arr->data)[i] = (float)(rand() % 100) / 3.0f;
-                break;
-            case TYPE_DOUBLE:
-                ((double*)arr->data)[i] = (double)(rand() % 100) / 7.0;
-                break;
-            case TYPE_CHAR:
-                ((char*)arr->data)[i] = (char)(rand() % 26 + 65);
-                break;
-            case TYPE_STRING:
-                // For simplicity, filling with single character strings
-                {
-                    char *str = (char*)malloc(2 * sizeof(char));
-                    str[0] = (char)(rand() % 26 + 65);
-                    str[1] = '\0';
-                    ((char**)arr->data)[i] = str;
-                }
-                break;
-        }
+    switch(type){
+        case TYPE_INT:
+            rng_fill_int(r, (int*)arr->data, size, 0, 99);
+            break;
+        case TYPE_FLOAT:
+            for(int i = 0; i < size; i++)
+                ((float*)arr->data)[i] = (float)rng_range(r, 0, 99) / 3.0f;
+            break;
+        case TYPE_DOUBLE:
+            for(int i = 0; i < size; i++)
+                ((double*)arr->data)[i] = (double)rng_range(r, 0, 99) / 7.0;
+            break;
+        case TYPE_CHAR:
+            for(int i = 0; i < size; i++)
+                ((char*)arr->data)[i] = (char)rng_range(r, 65, 90);
+            break;
+        case TYPE_STRING:
+            // For simplicity, filling with single character strings
+            for(int i = 0; i < size; i++){
+                char *str = (char*)malloc(2 * sizeof(char));
+                str[0] = (char)rng_range(r, 65, 90);
+                str[1] = '\0';
+                ((char**)arr->data)[i] = str;
+            }
+            break;
     }
     return arr;
 }
 
+// This function creates and returns an array filled with random values
+array* create_filled_array(int size, type_t type){
+    return create_filled_array_rng(size, type, NULL);
+}
+
 // This function frees the allocated memory for the array
 void free_array(array *arr){
     if (arr->type == TYPE_STRING) {
@@ -117,15 +155,64 @@ void free_array(array *arr){
 }
 
 
+/* Capacity management */
+
+// This function makes sure the array can hold at least capacity elements without reallocating
+// Returns 1 on success, 0 if the allocation failed (the array is left untouched)
+int array_reserve(array *arr, int capacity){
+    if(capacity <= arr->capacity) return 1;
+    if((size_t)capacity > SIZE_MAX / array_element_size(arr->type)){
+        fprintf(stderr,"Array size overflow\n");
+        return 0;
+    }
+    void *data = realloc(arr->data, (size_t)capacity * array_element_size(arr->type));
+    if(data == NULL){
+        fprintf(stderr,"Memory allocation failed\n");
+        return 0;
+    }
+    arr->data = data;
+    arr->capacity = capacity;
+    return 1;
+}
+
+// This function grows the capacity geometrically so that at least extra more elements fit
+// Returns 1 on success, 0 if the size would overflow or the allocation failed
+static int array_grow(array *arr, int extra){
+    if(extra > INT_MAX - arr->size){
+        fprintf(stderr,"Array size overflow\n");
+        return 0;
+    }
+    int needed = arr->size + extra;
+    if(needed <= arr->capacity) return 1;
+    int capacity = arr->capacity < 8 ? 8 : arr->capacity;
+    while(capacity < needed){
+        // Doubling past INT_MAX would overflow, so take exactly what is needed instead
+        capacity = capacity > INT_MAX / 2 ? needed : capacity * 2;
+    }
+    return array_reserve(arr, capacity);
+}
+
+// This function releases unused capacity so that capacity == size
+void array_shrink_to_fit(array *arr){
+    if(arr->capacity == arr->size) return;
+    if(arr->size == 0){
+        free(arr->data);
+        arr->data = NULL;
+        arr->capacity = 0;
+        return;
+    }
+    void *data = realloc(arr->data, (size_t)arr->size * array_element_size(arr->type));
+    if(data == NULL) return;
+    arr->data = data;
+    arr->capacity = arr->size;
+}
+
 /* Array element manipulations */
 
 // This function adds a new element at the end of the array
 void add_new_element(void *data, array *arr){
+    if(!array_grow(arr, 1)) return;
     arr->size += 1;
-    arr->data = realloc(arr->data, arr->size * 
-        (arr->type == TYPE_INT ? sizeof(int) : 
-        arr->type == TYPE_FLOAT ? sizeof(float) : 
-        arr->type == TYPE_DOUBLE ? sizeof(double) : sizeof(char)));
     switch(arr->type){
         case TYPE_INT:
             ((int*)arr->data)[arr->size - 1] = *(int*)data;
@@ -144,6 +231,43 @@ void add_new_element(void *data, array *arr){
     }
 }
 
+// This function appends n elements from a plain C buffer of the array's type
+// For TYPE_STRING the array takes ownership of the pointers, same as add_new_element
+void array_append_n(array *arr, const void *data, int n){
+    if(n <= 0) return;
+    if(!array_grow(arr, n)) return;
+    size_t elem = array_element_size(arr->type);
+    memcpy((char*)arr->data + (size_t)arr->size * elem, data, (size_t)n * elem);
+    arr->size += n;
+}
+
+// This function appends every element of src to the end of dst
+// For TYPE_STRING the strings are duplicated so both arrays can be freed independently
+void array_extend(array *dst, array *src){
+    if(dst->type != src->type){
+        fprintf(stderr,"Array type mismatch\n");
+        return;
+    }
+    int n = src->size;
+    if(n == 0) return;
+    if(!array_grow(dst, n)) return;
+    if(dst->type == TYPE_STRING){
+        for(int i = 0; i < n; i++){
+            const char *s = ((char**)src->data)[i];
+            size_t len = strlen(s) + 1;
+            char *copy = (char*)malloc(len);
+            if(copy == NULL){
+                fprintf(stderr,"Memory allocation failed\n");
+                return;
+            }
+            memcpy(copy, s, len);
+            ((char**)dst->data)[dst->size++] = copy;
+        }
+        return;
+    }
+    array_append_n(dst, src->data, n);
+}
+
 // This function puts an element at a given position in the array and overwrites existing data
 void push_element_at_pos(int pos, void *data, array *arr){
     if(pos < 0 || pos > arr->size){
@@ -192,10 +316,6 @@ void delete_element_at_pos(int pos, array *arr){
         }
     }
     arr->size -= 1;
-    arr->data = realloc(arr->data, arr->size * 
-        (arr->type == TYPE_INT ? sizeof(int) : 
-        arr->type == TYPE_FLOAT ? sizeof(float) : 
-        arr->type == TYPE_DOUBLE ? sizeof(double) : sizeof(char)));
 }
 
 // This function gets the size of the array
@@ -329,74 +449,167 @@ void get_element_input_at_pos(int pos, array *arr){
 }
 
 /* Search Algorithms */
+// Linear search is done by per-type kernels. On x86 with GCC/Clang there are SSE2 and
+// AVX2 versions that compare a whole vector of lanes at once and turn the result into
+// a bitmask with movemask; the AVX2 ones are picked at runtime when the CPU has it.
+#define SEARCH_FIRST 0
+#define SEARCH_COUNT 1
+#define SEARCH_COLLECT 2
+
+// Where SEARCH_COLLECT puts matching indices: straight into a caller's buffer
+// (raw, which must have room for every match) or appended to a TYPE_INT array
+typedef struct {
+    int *raw;
+    int n;
+    array *arr;
+} search_sink;
+
+static inline int search_push_index(search_sink *out, int idx){
+    if(out->raw){
+        out->raw[out->n++] = idx;
+        return 1;
+    }
+    array *arr = out->arr;
+    if(arr->size == arr->capacity && !array_grow(arr, 1)) return 0;
+    ((int*)arr->data)[arr->size++] = idx;
+    return 1;
+}
+
+// Handles one match at index idx. Returns 1 if the scan should stop.
+#define CARRAY_SEARCH_HIT(idx)                                                         \
+    do {                                                                               \
+        if(mode == SEARCH_FIRST) return (idx);                                         \
+        count++;                                                                       \
+        if(mode == SEARCH_COLLECT && !search_push_index(out, (idx))) return count;     \
+    } while(0)
+
+#define CARRAY_SEARCH_SCALAR(NAME, T, EQ)                                              \
+static int search_kernel_##NAME(T const *d, int n, T v, int mode, search_sink *out){   \
+    int count = 0;                                                                     \
+    for(int i = 0; i < n; i++){                                                        \
+        if(EQ(d[i], v)) CARRAY_SEARCH_HIT(i);                                          \
+    }                                                                                  \
+    return mode == SEARCH_FIRST ? -1 : count;                                          \
+}
+
+CARRAY_SEARCH_SCALAR(int, int, CARRAY_EQ_NUM)
+CARRAY_SEARCH_SCALAR(float, float, CARRAY_EQ_NUM)
+CARRAY_SEARCH_SCALAR(double, double, CARRAY_EQ_NUM)
+CARRAY_SEARCH_SCALAR(char, char, CARRAY_EQ_NUM)
+CARRAY_SEARCH_SCALAR(str, char*, CARRAY_EQ_STR)
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CARRAY_SEARCH_SIMD 1
+#include <immintrin.h>
+
+// SETUP declares the broadcast needle, MASK(p) returns the match bitmask for the
+// LANES elements starting at p
+#define CARRAY_SEARCH_VECTOR(FN, T, ISA, LANES, SETUP, MASK)                           \
+__attribute__((target(ISA)))                                                           \
+static int FN(const T *d, int n, T v, int mode, search_sink *out){                     \
+    SETUP;                                                                             \
+    int count = 0, i = 0;                                                              \
+    for(; i + LANES <= n; i += LANES){                                                 \
+        unsigned int mask = (unsigned int)(MASK(d + i));                               \
+        if(mask == 0) continue;                                                        \
+        if(mode == SEARCH_FIRST) return i + __builtin_ctz(mask);                       \
+        if(mode == SEARCH_COUNT){                                                      \
+            count += __builtin_popcount(mask);                                         \
+            continue;                                                                  \
+        }                                                                              \
+        while(mask){                                                                   \
+            count++;                                                                   \
+            if(!search_push_index(out, i + __builtin_ctz(mask))) return count;         \
+            mask &= mask - 1;                                                          \
+        }                                                                              \
+    }                                                                                  \
+    for(; i < n; i++){                                                                 \
+        if(d[i] == v) CARRAY_SEARCH_HIT(i);                                            \
+    }                                                                                  \
+    return mode == SEARCH_FIRST ? -1 : count;                                          \
+}
+
+#define SSE2_MASK_INT(p)    _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(p)), needle)))
+#define SSE2_MASK_FLOAT(p)  _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(p), needle))
+#define SSE2_MASK_DOUBLE(p) _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(p), needle))
+#define SSE2_MASK_CHAR(p)   _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p)), needle))
+#define AVX2_MASK_INT(p)    _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)(p)), needle)))
+#define AVX2_MASK_FLOAT(p)  _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(p), needle, _CMP_EQ_OQ))
+#define AVX2_MASK_DOUBLE(p) _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(p), needle, _CMP_EQ_OQ))
+#define AVX2_MASK_CHAR(p)   _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p)), needle))
+
+CARRAY_SEARCH_VECTOR(search_kernel_int_sse2, int, "sse2", 4, __m128i needle = _mm_set1_epi32(v), SSE2_MASK_INT)
+CARRAY_SEARCH_VECTOR(search_kernel_float_sse2, float, "sse2", 4, __m128 needle = _mm_set1_ps(v), SSE2_MASK_FLOAT)
+CARRAY_SEARCH_VECTOR(search_kernel_double_sse2, double, "sse2", 2, __m128d needle = _mm_set1_pd(v), SSE2_MASK_DOUBLE)
+CARRAY_SEARCH_VECTOR(search_kernel_char_sse2, char, "sse2", 16, __m128i needle = _mm_set1_epi8(v), SSE2_MASK_CHAR)
+CARRAY_SEARCH_VECTOR(search_kernel_int_avx2, int, "avx2", 8, __m256i needle = _mm256_set1_epi32(v), AVX2_MASK_INT)
+CARRAY_SEARCH_VECTOR(search_kernel_float_avx2, float, "avx2", 8, __m256 needle = _mm256_set1_ps(v), AVX2_MASK_FLOAT)
+CARRAY_SEARCH_VECTOR(search_kernel_double_avx2, double, "avx2", 4, __m256d needle = _mm256_set1_pd(v), AVX2_MASK_DOUBLE)
+CARRAY_SEARCH_VECTOR(search_kernel_char_avx2, char, "avx2", 32, __m256i needle = _mm256_set1_epi8(v), AVX2_MASK_CHAR)
+
+// Returns 2 for AVX2, 1 for SSE2 and 0 for scalar only. Checked once and cached.
+static int carray_simd_level(void){
+    static int level = -1;
+    if(level < 0){
+        __builtin_cpu_init();
+        level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("sse2") ? 1 : 0;
+    }
+    return level;
+}
+#endif
+
+// Runs the best search kernel for the array type.
+// SEARCH_FIRST returns the first matching index or -1; SEARCH_COUNT returns the
+// number of matches; SEARCH_COLLECT also passes each index to out.
+#ifdef CARRAY_SEARCH_SIMD
+#define CARRAY_SEARCH_DISPATCH(NAME, T)                                                \
+    if(level == 2) return search_kernel_##NAME##_avx2((const T*)arr->data, n, *(const T*)value, mode, out); \
+    if(level == 1) return search_kernel_##NAME##_sse2((const T*)arr->data, n, *(const T*)value, mode, out); \
+    return search_kernel_##NAME((const T*)arr->data, n, *(const T*)value, mode, out);
+#else
+#define CARRAY_SEARCH_DISPATCH(NAME, T)                                                \
+    return search_kernel_##NAME((const T*)arr->data, n, *(const T*)value, mode, out);
+#endif
+
+static int search_buffer(const void *value, array *arr, int mode, search_sink *out){
+    int n = arr->size;
+#ifdef CARRAY_SEARCH_SIMD
+    int level = carray_simd_level();
+#endif
+    switch(arr->type){
+        case TYPE_INT:    CARRAY_SEARCH_DISPATCH(int, int)
+        case TYPE_FLOAT:  CARRAY_SEARCH_DISPATCH(float, float)
+        case TYPE_DOUBLE: CARRAY_SEARCH_DISPATCH(double, double)
+        case TYPE_CHAR:   CARRAY_SEARCH_DISPATCH(char, char)
+        case TYPE_STRING:
+            return search_kernel_str((char* const*)arr->data, n, *(char* const*)value, mode, out);
+    }
+    return mode == SEARCH_FIRST ? -1 : 0;
+}
+
+// This function returns a new TYPE_INT array holding every position where value occurs
+array* search_positions(void *value, array *arr){
+    search_sink out = { NULL, 0, create_array(0, TYPE_INT) };
+    search_buffer(value, arr, SEARCH_COLLECT, &out);
+    return out.arr;
+}
+
+// This function returns how many times value occurs in the array
+int search_count(void *value, array *arr){
+    return search_buffer(value, arr, SEARCH_COUNT, NULL);
+}
 
 // This function searches for a value in the array and returns its position
+// indexs must have room for every match; use search_positions when the count is unknown
 void search_pos_by_value(void *value, array *arr, int *indexs, int *count){
-    int found = 0;
-    for(int i = 0; i < arr->size; i++){
-        switch(arr->type){
-            case TYPE_INT:
-                if(((int*)arr->data)[i] == *(int*)value){
-                    indexs[found++] = i;
-                }
-                break;
-            case TYPE_FLOAT:
-                if(((float*)arr->data)[i] == *(float*)value){
-                    indexs[found++] = i;
-                }
-                break;
-            case TYPE_DOUBLE:
-                if(((double*)arr->data)[i] == *(double*)value){
-                    indexs[found++] = i;
-                }
-                break;
-            case TYPE_CHAR:
-                if(((char*)arr->data)[i] == *(char*)value){
-                    indexs[found++] = i;
-                }
-                break;
-            case TYPE_STRING:
-                if(strcmp(((char**)arr->data)[i], *(char**)value) == 0){
-                    indexs[found++] = i;
-                }
-                break;
-        }
-    }
-    *count = found;
+    search_sink out = { indexs, 0, NULL };
+    search_buffer(value, arr, SEARCH_COLLECT, &out);
+    *count = out.n;
 }
 
 // This function searches for a value in the array and returns 1 if found, else 0
 int search_value_exists(void *value, array *arr){
-    for(int i = 0; i < arr->size; i++){
-        switch(arr->type){
-            case TYPE_INT:
-                if(((int*)arr->data)[i] == *(int*)value){
-                    return 1;
-                }
-                break;
-            case TYPE_FLOAT:
-                if(((float*)arr->data)[i] == *(float*)value){
-                    return 1;
-                }
-                break;
-            case TYPE_DOUBLE:
-                if(((double*)arr->data)[i] == *(double*)value){
-                    return 1;
-                }
-                break;
-            case TYPE_CHAR:
-                if(((char*)arr->data)[i] == *(char*)value){
-                    return 1;
-                }
-                break;
-            case TYPE_STRING:
-                if(strcmp(((char**)arr->data)[i], *(char**)value) == 0){
-                    return 1;
-                }
-                break;
-        }
-    }
-    return 0;
+    return search_buffer(value, arr, SEARCH_FIRST, NULL) != -1;
 }
 
 // This function searches for a value in the array at a given index and returns 1 if found, else 0
@@ -422,11 +635,517 @@ int search_value_at_index(void *value, int index, array *arr){
 
 
 
+/* Typed Arrays */
+// CARRAY_DEFINE stamps out a fully typed array (array_<name>) whose operations are
+// static inline and work directly on T, so there is no per-element type switch.
+// The dynamic `array` above remains the generic interface; use array_<name>_from
+// to copy one into its typed counterpart.
+
+// CARRAY_DEFINE_SORT generates array_<name>_sort_range(T *d, int n), an introsort:
+// ninther / median-of-three pivot, three-way partition so runs of equal keys are
+// finished in one pass, insertion sort for small ranges, heapsort once the depth
+// budget is spent, and an explicit stack instead of recursion.
+#define CARRAY_INSERTION_THRESHOLD 24
+#define CARRAY_NINTHER_THRESHOLD 128
+#ifdef __GNUC__
+#define CARRAY_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define CARRAY_PREFETCH(p) ((void)0)
+#endif
+#define CARRAY_SWAP(T, a, b) do { T carray_tmp_ = (a); (a) = (b); (b) = carray_tmp_; } while(0)
+
+#define CARRAY_DEFINE_SORT(NAME, T, LESS)                                              \
+static inline void array_##NAME##_insertion_sort(T *d, int lo, int hi){               \
+    for(int i = lo + 1; i <= hi; i++){                                                 \
+        T key = d[i];                                                                  \
+        int j = i - 1;                                                                 \
+        while(j >= lo && LESS(key, d[j])){                                             \
+            d[j + 1] = d[j];                                                           \
+            j--;                                                                       \
+        }                                                                              \
+        d[j + 1] = key;                                                                \
+    }                                                                                  \
+}                                                                                      \
+                                                                                       \
+static inline void array_##NAME##_sift_down(T *d, int root, int n){                   \
+    T value = d[root];                                                                 \
+    int child;                                                                         \
+    while((child = 2 * root + 1) < n){                                                 \
+        if(child + 1 < n && LESS(d[child], d[child + 1])) child++;                     \
+        if(!LESS(value, d[child])) break;                                              \
+        d[root] = d[child];                                                            \
+        root = child;                                                                  \
+    }                                                                                  \
+    d[root] = value;                                                                   \
+}                                                                                      \
+                                                                                       \
+static inline void array_##NAME##_heap_sort(T *d, int n){                             \
+    for(int i = n / 2 - 1; i >= 0; i--) array_##NAME##_sift_down(d, i, n);             \
+    for(int i = n - 1; i > 0; i--){                                                    \
+        CARRAY_SWAP(T, d[0], d[i]);                                                    \
+        array_##NAME##_sift_down(d, 0, i);                                             \
+    }                                                                                  \
+}                                                                                      \
+                                                                                       \
+static inline int array_##NAME##_median3(T *d, int a, int b, int c){                  \
+    if(LESS(d[a], d[b])){                                                              \
+        if(LESS(d[b], d[c])) return b;                                                 \
+        return LESS(d[a], d[c]) ? c : a;                                               \
+    }                                                                                  \
+    if(LESS(d[a], d[c])) return a;                                                     \
+    return LESS(d[b], d[c]) ? c : b;                                                   \
+}                                                                                      \
+                                                                                       \
+static inline void array_##NAME##_sort_range(T *d, int n){                            \
+    struct { int lo, hi, depth; } stack[64];                                           \
+    int top = 0;                                                                       \
+    if(n < 2) return;                                                                  \
+    int sorted = 1, reversed = 1;                                                      \
+    for(int i = 1; i < n && (sorted || reversed); i++){                                \
+        if(LESS(d[i], d[i - 1])) sorted = 0;                                           \
+        if(!LESS(d[i], d[i - 1])) reversed = 0;                                        \
+    }                                                                                  \
+    if(sorted) return;                                                                 \
+    if(reversed){                                                                      \
+        for(int i = 0, j = n - 1; i < j; i++, j--) CARRAY_SWAP(T, d[i], d[j]);         \
+        return;                                                                        \
+    }                                                                                  \
+    int depth = 0;                                                                     \
+    for(int m = n; m > 1; m >>= 1) depth += 2;                                         \
+    int lo = 0, hi = n - 1;                                                            \
+    for(;;){                                                                           \
+        while(hi - lo + 1 > CARRAY_INSERTION_THRESHOLD){                               \
+            int len = hi - lo + 1;                                                     \
+            if(depth == 0){                                                            \
+                array_##NAME##_heap_sort(d + lo, len);                                 \
+                lo = hi;                                                               \
+                break;                                                                 \
+            }                                                                          \
+            depth--;                                                                   \
+            int mid = lo + len / 2, p;                                                 \
+            if(len > CARRAY_NINTHER_THRESHOLD){                                        \
+                int s = len / 8;                                                       \
+                p = array_##NAME##_median3(d,                                          \
+                        array_##NAME##_median3(d, lo, lo + s, lo + 2 * s),             \
+                        array_##NAME##_median3(d, mid - s, mid, mid + s),              \
+                        array_##NAME##_median3(d, hi - 2 * s, hi - s, hi));            \
+            } else {                                                                   \
+                p = array_##NAME##_median3(d, lo, mid, hi);                            \
+            }                                                                          \
+            T pivot = d[p];                                                            \
+            int lt = lo, i = lo, gt = hi;                                              \
+            while(i <= gt){                                                            \
+                if(LESS(d[i], pivot)){                                                 \
+                    CARRAY_SWAP(T, d[lt], d[i]);                                       \
+                    lt++; i++;                                                         \
+                } else if(LESS(pivot, d[i])){                                          \
+                    CARRAY_SWAP(T, d[i], d[gt]);                                       \
+                    gt--;                                                              \
+                } else {                                                               \
+                    i++;                                                               \
+                }                                                                      \
+            }                                                                          \
+            if(lt - lo < hi - gt){                                                     \
+                stack[top].lo = gt + 1; stack[top].hi = hi;                            \
+                stack[top].depth = depth; top++;                                       \
+                hi = lt - 1;                                                           \
+            } else {                                                                   \
+                stack[top].lo = lo; stack[top].hi = lt - 1;                            \
+                stack[top].depth = depth; top++;                                       \
+                lo = gt + 1;                                                           \
+            }                                                                          \
+        }                                                                              \
+        if(lo < hi) array_##NAME##_insertion_sort(d, lo, hi);                          \
+        if(top == 0) break;                                                            \
+        top--;                                                                         \
+        lo = stack[top].lo; hi = stack[top].hi; depth = stack[top].depth;              \
+    }                                                                                  \
+}
+
+// CARRAY_DEFINE_MERGE generates the stable two-run merge kernels used by
+// sort_array_parallel. They take void pointers so they can sit in a dispatch table.
+// array_<name>_corank returns how many elements of a are among the first k
+// elements of merge(a, b).
+#define CARRAY_DEFINE_MERGE(NAME, T, LESS)                                             \
+static inline int array_##NAME##_corank(const void *va, int m, const void *vb, int l, int k){ \
+    T const *a = (T const*)va;                                                         \
+    T const *b = (T const*)vb;                                                         \
+    int lo = k > l ? k - l : 0, hi = k < m ? k : m;                                    \
+    while(lo < hi){                                                                    \
+        int i = lo + (hi - lo) / 2, j = k - i;                                         \
+        if(j > 0 && !LESS(b[j - 1], a[i])) lo = i + 1;                                 \
+        else hi = i;                                                                   \
+    }                                                                                  \
+    return lo;                                                                         \
+}                                                                                      \
+                                                                                       \
+static inline void array_##NAME##_merge(const void *va, int m, const void *vb, int l, void *vout){ \
+    T const *a = (T const*)va;                                                         \
+    T const *b = (T const*)vb;                                                         \
+    T *out = (T*)vout;                                                                 \
+    int i = 0, j = 0, k = 0;                                                           \
+    while(i < m && j < l) out[k++] = LESS(b[j], a[i]) ? b[j++] : a[i++];               \
+    while(i < m) out[k++] = a[i++];                                                    \
+    while(j < l) out[k++] = b[j++];                                                    \
+}
+
+// CARRAY_DEFINE_BSEARCH generates binary search kernels over a sorted T buffer.
+// The loops are branchless: each step is a compare and a conditional add.
+// array_<name>_lower_bound_batch looks up m sorted probes with one forward pass,
+// galloping from the previous answer, which is O(m log(n / m)) instead of O(m log n).
+// array_<name>_eytzinger_* store the sorted values in BFS (Eytzinger) order, slot 0
+// unused, so the top levels of the search share a few cache lines.
+#define CARRAY_DEFINE_BSEARCH(NAME, T, LESS)                                           \
+static inline int array_##NAME##_lower_bound_range(T const *d, int n, T v){           \
+    if(n <= 0) return 0;                                                               \
+    T const *base = d;                                                                 \
+    while(n > 1){                                                                      \
+        int half = n / 2;                                                              \
+        base += LESS(base[half - 1], v) ? half : 0;                                    \
+        n -= half;                                                                     \
+    }                                                                                  \
+    return (int)(base - d) + (LESS(*base, v) ? 1 : 0);                                 \
+}                                                                                      \
+                                                                                       \
+static inline int array_##NAME##_upper_bound_range(T const *d, int n, T v){           \
+    if(n <= 0) return 0;                                                               \
+    T const *base = d;                                                                 \
+    while(n > 1){                                                                      \
+        int half = n / 2;                                                              \
+        base += LESS(v, base[half - 1]) ? 0 : half;                                    \
+        n -= half;                                                                     \
+    }                                                                                  \
+    return (int)(base - d) + (LESS(v, *base) ? 0 : 1);                                 \
+}                                                                                      \
+                                                                                       \
+static inline void array_##NAME##_lower_bound_batch(T const *d, int n, T const *probes, int m, int *out){ \
+    int pos = 0;                                                                       \
+    for(int p = 0; p < m; p++){                                                        \
+        T v = probes[p];                                                               \
+        if(pos < n && LESS(d[pos], v)){                                                \
+            int lo = pos, step = 1, hi = pos + 1;                                      \
+            while(hi < n && LESS(d[hi], v)){                                           \
+                lo = hi;                                                               \
+                step *= 2;                                                             \
+                hi = n - lo > step ? lo + step : n;                                    \
+            }                                                                          \
+            pos = lo + 1 + array_##NAME##_lower_bound_range(d + lo + 1, hi - lo - 1, v); \
+        }                                                                              \
+        out[p] = pos;                                                                  \
+    }                                                                                  \
+}                                                                                      \
+                                                                                       \
+static inline int array_##NAME##_eytzinger_fill(T *e, T const *d, int n, int i, int k){ \
+    if(k <= n){                                                                        \
+        i = array_##NAME##_eytzinger_fill(e, d, n, i, 2 * k);                          \
+        e[k] = d[i++];                                                                 \
+        i = array_##NAME##_eytzinger_fill(e, d, n, i, 2 * k + 1);                      \
+    }                                                                                  \
+    return i;                                                                          \
+}                                                                                      \
+                                                                                       \
+/* Returns the Eytzinger slot of the first element >= v, or 0 if there is none */     \
+static inline int array_##NAME##_eytzinger_lower_bound(T const *e, int n, T v){       \
+    int k = 1;                                                                         \
+    while(k <= n){                                                                     \
+        CARRAY_PREFETCH(e + (size_t)k * (64 / sizeof(T) > 1 ? 64 / sizeof(T) : 1));     \
+        k = 2 * k + (LESS(e[k], v) ? 1 : 0);                                           \
+    }                                                                                  \
+    while(k & 1) k >>= 1;                                                              \
+    return k >> 1;                                                                     \
+}
+
+#define CARRAY_DEFINE(T) CARRAY_DEFINE_FULL(T, T, CARRAY_LESS_NUM, CARRAY_EQ_NUM)
+
+#define CARRAY_DEFINE_FULL(NAME, T, LESS, EQ)                                          \
+CARRAY_DEFINE_SORT(NAME, T, LESS)                                                      \
+CARRAY_DEFINE_MERGE(NAME, T, LESS)                                                     \
+CARRAY_DEFINE_BSEARCH(NAME, T, LESS)                                                   \
+typedef struct {                                                                       \
+    int size;                                                                          \
+    int capacity;                                                                      \
+    T *data;                                                                           \
+} array_##NAME;                                                                        \
+                                                                                       \
+static inline array_##NAME* array_##NAME##_create(int capacity){                      \
+    array_##NAME *arr = (array_##NAME*)malloc(sizeof(array_##NAME));                  \
+    arr->size = 0;                                                                     \
+    arr->capacity = capacity > 0 ? capacity : 0;                                       \
+    arr->data = arr->capacity ? (T*)malloc((size_t)arr->capacity * sizeof(T)) : NULL;  \
+    return arr;                                                                        \
+}                                                                                      \
+                                                                                       \
+static inline void array_##NAME##_free(array_##NAME *arr){                            \
+    free(arr->data);                                                                   \
+    free(arr);                                                                         \
+}                                                                                      \
+                                                                                       \
+static inline int array_##NAME##_reserve(array_##NAME *arr, int capacity){            \
+    if(capacity <= arr->capacity) return 1;                                            \
+    T *data = (T*)realloc(arr->data, (size_t)capacity * sizeof(T));                    \
+    if(data == NULL) return 0;                                                         \
+    arr->data = data;                                                                  \
+    arr->capacity = capacity;                                                          \
+    return 1;                                                                          \
+}                                                                                      \
+                                                                                       \
+static inline void array_##NAME##_push(array_##NAME *arr, T value){                   \
+    if(arr->size == arr->capacity &&                                                   \
+       !array_##NAME##_reserve(arr, arr->capacity < 8 ? 8 : arr->capacity * 2)) return;\
+    arr->data[arr->size++] = value;                                                    \
+}                                                                                      \
+                                                                                       \
+static inline T array_##NAME##_get(const array_##NAME *arr, int pos){                 \
+    return arr->data[pos];                                                             \
+}                                                                                      \
+                                                                                       \
+static inline void array_##NAME##_set(array_##NAME *arr, int pos, T value){           \
+    arr->data[pos] = value;                                                            \
+}                                                                                      \
+                                                                                       \
+static inline int array_##NAME##_find(const array_##NAME *arr, T value){              \
+    for(int i = 0; i < arr->size; i++){                                                \
+        if(EQ(arr->data[i], value)) return i;                                          \
+    }                                                                                  \
+    return -1;                                                                         \
+}                                                                                      \
+                                                                                       \
+static inline int array_##NAME##_contains(const array_##NAME *arr, T value){          \
+    return array_##NAME##_find(arr, value) != -1;                                      \
+}                                                                                      \
+                                                                                       \
+static inline int array_##NAME##_lower_bound(const array_##NAME *arr, T value){      \
+    return array_##NAME##_lower_bound_range(arr->data, arr->size, value);              \
+}                                                                                      \
+                                                                                       \
+static inline int array_##NAME##_upper_bound(const array_##NAME *arr, T value){      \
+    return array_##NAME##_upper_bound_range(arr->data, arr->size, value);              \
+}                                                                                      \
+                                                                                       \
+static inline void array_##NAME##_sort(array_##NAME *arr){                            \
+    if(arr->size < 2) return;                                                          \
+    array_##NAME##_sort_range(arr->data, arr->size);                                   \
+}
+
+// CARRAY_DEFINE_FROM adds array_<name>_from, which copies a dynamic array of the
+// matching type_t into a typed one. Returns NULL on a type mismatch.
+#define CARRAY_DEFINE_FROM(NAME, T, TYPE)                                              \
+static inline array_##NAME* array_##NAME##_from(array *src){                          \
+    if(src->type != TYPE){                                                             \
+        fprintf(stderr,"Array type mismatch\n");                                       \
+        return NULL;                                                                   \
+    }                                                                                  \
+    array_##NAME *arr = array_##NAME##_create(src->size);                              \
+    if(src->size > 0) memcpy(arr->data, src->data, (size_t)src->size * sizeof(T));     \
+    arr->size = src->size;                                                             \
+    return arr;                                                                        \
+}
+
+// Typed arrays for every type_t. array_str does not own its strings.
+CARRAY_DEFINE(int)
+CARRAY_DEFINE(float)
+CARRAY_DEFINE(double)
+CARRAY_DEFINE(char)
+CARRAY_DEFINE_FULL(str, char*, CARRAY_LESS_STR, CARRAY_EQ_STR)
+CARRAY_DEFINE_FROM(int, int, TYPE_INT)
+CARRAY_DEFINE_FROM(float, float, TYPE_FLOAT)
+CARRAY_DEFINE_FROM(double, double, TYPE_DOUBLE)
+CARRAY_DEFINE_FROM(char, char, TYPE_CHAR)
+CARRAY_DEFINE_FROM(str, char*, TYPE_STRING)
+
+/* Radix Sorting */
+// Numeric arrays at least this long are radix sorted by sort_array
+#define CARRAY_RADIX_THRESHOLD 1024
+
+// LSD radix sort of 32-bit keys, one byte per pass. All histograms are built in a
+// single read, and passes where every key shares the same byte are skipped.
+// Returns the buffer holding the sorted keys (keys or tmp).
+static uint32_t* radix_sort_u32(uint32_t *keys, uint32_t *tmp, int n){
+    size_t count[4][256];
+    memset(count, 0, sizeof(count));
+    for(int i = 0; i < n; i++){
+        uint32_t k = keys[i];
+        count[0][k & 0xFF]++;
+        count[1][(k >> 8) & 0xFF]++;
+        count[2][(k >> 16) & 0xFF]++;
+        count[3][k >> 24]++;
+    }
+    uint32_t *src = keys, *dst = tmp;
+    for(int pass = 0; pass < 4; pass++){
+        int shift = pass * 8;
+        if(count[pass][(src[0] >> shift) & 0xFF] == (size_t)n) continue;
+        size_t sum = 0;
+        for(int b = 0; b < 256; b++){
+            size_t c = count[pass][b];
+            count[pass][b] = sum;
+            sum += c;
+        }
+        for(int i = 0; i < n; i++){
+            uint32_t k = src[i];
+            dst[count[pass][(k >> shift) & 0xFF]++] = k;
+        }
+        uint32_t *t = src; src = dst; dst = t;
+    }
+    return src;
+}
+
+// Same as radix_sort_u32 for 64-bit keys
+static uint64_t* radix_sort_u64(uint64_t *keys, uint64_t *tmp, int n){
+    size_t (*count)[256] = (size_t(*)[256])calloc(8 * 256, sizeof(size_t));
+    if(count == NULL) return NULL;
+    for(int i = 0; i < n; i++){
+        uint64_t k = keys[i];
+        for(int pass = 0; pass < 8; pass++) count[pass][(k >> (pass * 8)) & 0xFF]++;
+    }
+    uint64_t *src = keys, *dst = tmp;
+    for(int pass = 0; pass < 8; pass++){
+        int shift = pass * 8;
+        if(count[pass][(src[0] >> shift) & 0xFF] == (size_t)n) continue;
+        size_t sum = 0;
+        for(int b = 0; b < 256; b++){
+            size_t c = count[pass][b];
+            count[pass][b] = sum;
+            sum += c;
+        }
+        for(int i = 0; i < n; i++){
+            uint64_t k = src[i];
+            dst[count[pass][(k >> shift) & 0xFF]++] = k;
+        }
+        uint64_t *t = src; src = dst; dst = t;
+    }
+    free(count);
+    return src;
+}
+
+// Radix sorts n ints. Returns 0 if the scratch buffer could not be allocated.
+int radix_sort_int(int *d, int n){
+    if(n < 2) return 1;
+    uint32_t *keys = (uint32_t*)malloc(2 * (size_t)n * sizeof(uint32_t));
+    if(keys == NULL) return 0;
+    for(int i = 0; i < n; i++) keys[i] = (uint32_t)d[i] ^ 0x80000000u;
+    uint32_t *sorted = radix_sort_u32(keys, keys + n, n);
+    for(int i = 0; i < n; i++) d[i] = (int)(sorted[i] ^ 0x80000000u);
+    free(keys);
+    return 1;
+}
+
+// Radix sorts n floats. Negative values have all bits flipped and positive values
+// only the sign bit, so the unsigned key order matches the float order.
+int radix_sort_float(float *d, int n){
+    if(n < 2) return 1;
+    uint32_t *keys = (uint32_t*)malloc(2 * (size_t)n * sizeof(uint32_t));
+    if(keys == NULL) return 0;
+    for(int i = 0; i < n; i++){
+        uint32_t u;
+        memcpy(&u, &d[i], sizeof(u));
+        keys[i] = (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+    }
+    uint32_t *sorted = radix_sort_u32(keys, keys + n, n);
+    for(int i = 0; i < n; i++){
+        uint32_t u = sorted[i];
+        u = (u & 0x80000000u) ? (u & 0x7FFFFFFFu) : ~u;
+        memcpy(&d[i], &u, sizeof(u));
+    }
+    free(keys);
+    return 1;
+}
+
+// Radix sorts n doubles with the same key transform as radix_sort_float
+int radix_sort_double(double *d, int n){
+    if(n < 2) return 1;
+    const uint64_t sign = 0x8000000000000000ull;
+    uint64_t *keys = (uint64_t*)malloc(2 * (size_t)n * sizeof(uint64_t));
+    if(keys == NULL) return 0;
+    for(int i = 0; i < n; i++){
+        uint64_t u;
+        memcpy(&u, &d[i], sizeof(u));
+        keys[i] = (u & sign) ? ~u : (u | sign);
+    }
+    uint64_t *sorted = radix_sort_u64(keys, keys + n, n);
+    if(sorted == NULL){
+        free(keys);
+        return 0;
+    }
+    for(int i = 0; i < n; i++){
+        uint64_t u = sorted[i];
+        u = (u & sign) ? (u & ~sign) : ~u;
+        memcpy(&d[i], &u, sizeof(u));
+    }
+    free(keys);
+    return 1;
+}
+
+// Counting sort for chars, in place
+void counting_sort_char(char *d, int n){
+    size_t count[256] = {0};
+    for(int i = 0; i < n; i++) count[(unsigned char)d[i]]++;
+    // Walk the buckets in signed char order so the result matches compare_elements
+    int pos = 0;
+    for(int v = CHAR_MIN; v <= CHAR_MAX; v++){
+        size_t c = count[(unsigned char)v];
+        memset(d + pos, v, c);
+        pos += (int)c;
+    }
+}
+
+// Multikey quicksort (Bentley-Sedgewick) for strings. Characters before depth are
+// known to be equal, so each string is only inspected from depth onward.
+static void multikey_sort_range(char **d, int n, int depth){
+    while(n > CARRAY_INSERTION_THRESHOLD){
+        int mid = n / 2;
+        int a = (unsigned char)d[0][depth];
+        int b = (unsigned char)d[mid][depth];
+        int c = (unsigned char)d[n - 1][depth];
+        int pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+
+        int lt = 0, i = 0, gt = n - 1;
+        while(i <= gt){
+            int ch = (unsigned char)d[i][depth];
+            if(ch < pivot){
+                CARRAY_SWAP(char*, d[lt], d[i]);
+                lt++; i++;
+            } else if(ch > pivot){
+                CARRAY_SWAP(char*, d[i], d[gt]);
+                gt--;
+            } else {
+                i++;
+            }
+        }
+        int n_lt = lt, n_eq = gt - lt + 1, n_gt = n - gt - 1;
+        // Loop on the largest part and recurse on the others to bound the stack
+        if(n_eq >= n_lt && n_eq >= n_gt && pivot != 0){
+            multikey_sort_range(d, n_lt, depth);
+            multikey_sort_range(d + gt + 1, n_gt, depth);
+            d += lt; n = n_eq; depth++;
+        } else if(n_lt >= n_gt){
+            if(pivot != 0) multikey_sort_range(d + lt, n_eq, depth + 1);
+            multikey_sort_range(d + gt + 1, n_gt, depth);
+            n = n_lt;
+        } else {
+            multikey_sort_range(d, n_lt, depth);
+            if(pivot != 0) multikey_sort_range(d + lt, n_eq, depth + 1);
+            d += gt + 1; n = n_gt;
+        }
+    }
+    for(int i = 1; i < n; i++){
+        char *key = d[i];
+        int j = i - 1;
+        while(j >= 0 && strcmp(key + depth, d[j] + depth) < 0){
+            d[j + 1] = d[j];
+            j--;
+        }
+        d[j + 1] = key;
+    }
+}
+
+void multikey_sort_str(char **d, int n){
+    multikey_sort_range(d, n, 0);
+}
+
 /* Sorting Algorithms */
-// This function sorts the array using Bubble Sort
 int compare_elements(array *arr, int idx1, int idx2) {
     switch(arr->type) {
-        case TYPE_INT:    return ((int*)arr->data)[idx1] - ((int*)arr->data)[idx2];
+        case TYPE_INT:    return (((int*)arr->data)[idx1] > ((int*)arr->data)[idx2]) - (((int*)arr->data)[idx1] < ((int*)arr->data)[idx2]);
         case TYPE_FLOAT:  return (((float*)arr->data)[idx1] > ((float*)arr->data)[idx2]) - (((float*)arr->data)[idx1] < ((float*)arr->data)[idx2]);
         case TYPE_DOUBLE: return (((double*)arr->data)[idx1] > ((double*)arr->data)[idx2]) - (((double*)arr->data)[idx1] < ((double*)arr->data)[idx2]);
         case TYPE_CHAR:   return ((char*)arr->data)[idx1] - ((char*)arr->data)[idx2];
@@ -471,30 +1190,316 @@ void swap_elements(array *arr, int idx1, int idx2) {
     }
 }
 
-// Partitioning logic (Lomuto partition scheme)
-
+// This function sorts the elements between low and high (inclusive) with the typed introsort
 void quick_sort_recursive(array *arr, int low, int high) {
-    if (low < high) {
-        int pivot_idx = high; 
-        int i = (low - 1);
+    if (low < 0 || high >= arr->size || low >= high) return;
+    int n = high - low + 1;
+    switch(arr->type) {
+        case TYPE_INT:    array_int_sort_range((int*)arr->data + low, n); break;
+        case TYPE_FLOAT:  array_float_sort_range((float*)arr->data + low, n); break;
+        case TYPE_DOUBLE: array_double_sort_range((double*)arr->data + low, n); break;
+        case TYPE_CHAR:   array_char_sort_range((char*)arr->data + low, n); break;
+        case TYPE_STRING: array_str_sort_range((char**)arr->data + low, n); break;
+    }
+}
 
-        for (int j = low; j <= high - 1; j++) {
-            if (compare_elements(arr, j, pivot_idx) < 0) {
-                i++;
-                swap_elements(arr, i, j);
+// This function sorts a raw buffer of n elements of the given type. Large numeric
+// buffers are radix sorted, chars are counting sorted and strings use multikey
+// quicksort; everything else goes through the introsort.
+void sort_buffer(void *data, int n, type_t type) {
+    if (n < 2) return;
+    switch(type) {
+        case TYPE_INT:
+            if (n < CARRAY_RADIX_THRESHOLD || !radix_sort_int((int*)data, n))
+                array_int_sort_range((int*)data, n);
+            break;
+        case TYPE_FLOAT:
+            if (n < CARRAY_RADIX_THRESHOLD || !radix_sort_float((float*)data, n))
+                array_float_sort_range((float*)data, n);
+            break;
+        case TYPE_DOUBLE:
+            if (n < CARRAY_RADIX_THRESHOLD || !radix_sort_double((double*)data, n))
+                array_double_sort_range((double*)data, n);
+            break;
+        case TYPE_CHAR:
+            counting_sort_char((char*)data, n);
+            break;
+        case TYPE_STRING:
+            multikey_sort_str((char**)data, n);
+            break;
+    }
+}
+
+// This function sorts the array in ascending order
+void sort_array(array *arr) {
+    if (arr == NULL || arr->size < 2) return;
+    sort_buffer(arr->data, arr->size, arr->type);
+}
+
+/* Parallel Sorting */
+// Arrays shorter than this are sorted on the calling thread
+#define CARRAY_PARALLEL_SORT_CUTOFF 65536
+#define CARRAY_MAX_SORT_THREADS 256
+
+#ifndef CARRAY_NO_THREADS
+typedef int (*carray_corank_fn)(const void *a, int m, const void *b, int l, int k);
+typedef void (*carray_merge_fn)(const void *a, int m, const void *b, int l, void *out);
+
+typedef struct {
+    int pair;   // which pair of runs the split falls in
+    int i, j;   // elements taken from the left and right run so far
+} sort_split;
+
+typedef struct {
+    type_t type;
+    size_t elem;
+    char *src;
+    char *dst;
+    int count;            // chunk length in the sort phase
+    int running;          // set when the task runs on its own thread
+    const int *bounds;    // run boundaries, nruns + 1 entries
+    int nruns;
+    const sort_split *from;
+    const sort_split *to;
+    carray_merge_fn merge;
+} sort_task;
+
+static void* sort_chunk_worker(void *p) {
+    sort_task *t = (sort_task*)p;
+    sort_buffer(t->src, t->count, t->type);
+    return NULL;
+}
+
+// Merges the output range between two splits, which may cover several run pairs
+static void* sort_merge_worker(void *p) {
+    sort_task *t = (sort_task*)p;
+    int pair = t->from->pair, i = t->from->i, j = t->from->j;
+    while (pair <= t->to->pair && pair * 2 < t->nruns) {
+        int lo = t->bounds[pair * 2];
+        int mid = t->bounds[pair * 2 + 1];
+        int hi = pair * 2 + 2 <= t->nruns ? t->bounds[pair * 2 + 2] : mid;
+        int i_end = mid - lo, j_end = hi - mid;
+        if (pair == t->to->pair) {
+            i_end = t->to->i;
+            j_end = t->to->j;
+        }
+        t->merge(t->src + (size_t)(lo + i) * t->elem, i_end - i,
+                 t->src + (size_t)(mid + j) * t->elem, j_end - j,
+                 t->dst + (size_t)(lo + i + j) * t->elem);
+        pair++;
+        i = j = 0;
+    }
+    return NULL;
+}
+
+// This function sorts the array using up to nthreads threads. Each thread sorts one
+// chunk, then the sorted runs are merged pairwise; every merge round is split into
+// equal output ranges (one per thread) using co-rank binary searches, so the sorted
+// contents do not depend on the thread count or scheduling.
+void sort_array_parallel(array *arr, int nthreads) {
+    if (arr == NULL || arr->size < 2) return;
+    int n = arr->size;
+    if (nthreads > CARRAY_MAX_SORT_THREADS) nthreads = CARRAY_MAX_SORT_THREADS;
+    if (nthreads > n / (CARRAY_PARALLEL_SORT_CUTOFF / 4)) nthreads = n / (CARRAY_PARALLEL_SORT_CUTOFF / 4);
+    if (nthreads < 2 || n < CARRAY_PARALLEL_SORT_CUTOFF) {
+        sort_array(arr);
+        return;
+    }
+
+    carray_corank_fn corank = NULL;
+    carray_merge_fn merge = NULL;
+    switch(arr->type) {
+        case TYPE_INT:    corank = array_int_corank;    merge = array_int_merge;    break;
+        case TYPE_FLOAT:  corank = array_float_corank;  merge = array_float_merge;  break;
+        case TYPE_DOUBLE: corank = array_double_corank; merge = array_double_merge; break;
+        case TYPE_CHAR:   corank = array_char_corank;   merge = array_char_merge;   break;
+        case TYPE_STRING: corank = array_str_corank;    merge = array_str_merge;    break;
+    }
+
+    size_t elem = array_element_size(arr->type);
+    char *tmp = (char*)malloc((size_t)n * elem);
+    if (tmp == NULL) {
+        sort_array(arr);
+        return;
+    }
+
+    pthread_t threads[CARRAY_MAX_SORT_THREADS];
+    sort_task tasks[CARRAY_MAX_SORT_THREADS];
+    sort_split splits[CARRAY_MAX_SORT_THREADS + 1];
+    int bounds[CARRAY_MAX_SORT_THREADS + 1];
+    int nruns = nthreads;
+    for (int t = 0; t <= nruns; t++) bounds[t] = (int)((long long)n * t / nruns);
+
+    // Phase 1: sort each chunk independently
+    for (int t = 0; t < nthreads; t++) {
+        tasks[t].type = arr->type;
+        tasks[t].src = (char*)arr->data + (size_t)bounds[t] * elem;
+        tasks[t].count = bounds[t + 1] - bounds[t];
+        tasks[t].running = pthread_create(&threads[t], NULL, sort_chunk_worker, &tasks[t]) == 0;
+        if (!tasks[t].running) sort_chunk_worker(&tasks[t]);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        if (tasks[t].running) pthread_join(threads[t], NULL);
+    }
+
+    // Phase 2: merge runs pairwise until one remains
+    char *src = (char*)arr->data, *dst = tmp;
+    while (nruns > 1) {
+        int npairs = (nruns + 1) / 2;
+        for (int t = 0; t <= nthreads; t++) {
+            int k = (int)((long long)n * t / nthreads);
+            int pair = 0;
+            while (pair + 1 < npairs && bounds[pair * 2 + 2] <= k) pair++;
+            if (t == nthreads) pair = npairs - 1;
+            int lo = bounds[pair * 2];
+            int mid = bounds[pair * 2 + 1];
+            int hi = pair * 2 + 2 <= nruns ? bounds[pair * 2 + 2] : mid;
+            int m = mid - lo, l = hi - mid;
+            k -= lo;
+            int i = corank(src + (size_t)lo * elem, m, src + (size_t)mid * elem, l, k);
+            // Keep splits within a pair monotonic even if the comparison is not a strict weak order
+            if (t > 0 && splits[t - 1].pair == pair) {
+                int min_i = splits[t - 1].i, max_i = k - splits[t - 1].j;
+                if (i < min_i) i = min_i;
+                if (i > max_i) i = max_i;
             }
+            splits[t].pair = pair;
+            splits[t].i = i;
+            splits[t].j = k - i;
+        }
+        for (int t = 0; t < nthreads; t++) {
+            tasks[t].elem = elem;
+            tasks[t].src = src;
+            tasks[t].dst = dst;
+            tasks[t].bounds = bounds;
+            tasks[t].nruns = nruns;
+            tasks[t].from = &splits[t];
+            tasks[t].to = &splits[t + 1];
+            tasks[t].merge = merge;
+            tasks[t].running = pthread_create(&threads[t], NULL, sort_merge_worker, &tasks[t]) == 0;
+            if (!tasks[t].running) sort_merge_worker(&tasks[t]);
         }
-        swap_elements(arr, i + 1, high);
-        int pi = i + 1;
+        for (int t = 0; t < nthreads; t++) {
+            if (tasks[t].running) pthread_join(threads[t], NULL);
+        }
+        for (int r = 0; r < npairs; r++) bounds[r] = bounds[r * 2];
+        bounds[npairs] = n;
+        nruns = npairs;
+        char *swap = src; src = dst; dst = swap;
+    }
+
+    if (src != (char*)arr->data) memcpy(arr->data, src, (size_t)n * elem);
+    free(tmp);
+}
+#else
+// Without threads this is sort_array
+void sort_array_parallel(array *arr, int nthreads) {
+    (void)nthreads;
+    sort_array(arr);
+}
+#endif // CARRAY_NO_THREADS
 
-        quick_sort_recursive(arr, low, pi - 1);
-        quick_sort_recursive(arr, pi + 1, high);
+/* Binary Search */
+// These functions expect the array to be sorted in ascending order (see sort_array)
+
+#define CARRAY_BSEARCH_DISPATCH(arr, CALL)                                             \
+    switch((arr)->type){                                                               \
+        case TYPE_INT:    CALL(int, int)                                               \
+        case TYPE_FLOAT:  CALL(float, float)                                           \
+        case TYPE_DOUBLE: CALL(double, double)                                         \
+        case TYPE_CHAR:   CALL(char, char)                                             \
+        case TYPE_STRING: CALL(str, char*)                                             \
     }
+
+// This function returns the index of the first element that is not less than value
+int array_lower_bound(array *arr, void *value){
+#define LOWER(NAME, T) return array_##NAME##_lower_bound_range((T const*)arr->data, arr->size, *(T const*)value);
+    CARRAY_BSEARCH_DISPATCH(arr, LOWER)
+#undef LOWER
+    return 0;
 }
 
-void sort_array(array *arr) {
-    if (arr == NULL || arr->size < 2) return;
-    quick_sort_recursive(arr, 0, arr->size - 1);
+// This function returns the index of the first element that is greater than value
+int array_upper_bound(array *arr, void *value){
+#define UPPER(NAME, T) return array_##NAME##_upper_bound_range((T const*)arr->data, arr->size, *(T const*)value);
+    CARRAY_BSEARCH_DISPATCH(arr, UPPER)
+#undef UPPER
+    return 0;
+}
+
+// This function returns the index of an element equal to value, or -1 if there is none
+int array_binary_search(array *arr, void *value){
+    int pos = array_lower_bound(arr, value);
+    if(pos < arr->size && search_value_at_index(value, pos, arr)) return pos;
+    return -1;
+}
+
+// This function stores the half-open range [*first, *last) of elements equal to value
+void array_equal_range(array *arr, void *value, int *first, int *last){
+    *first = array_lower_bound(arr, value);
+    *last = array_upper_bound(arr, value);
+}
+
+// This function finds the lower bound of every element of probes (same type, sorted)
+// in a single pass over arr. out must have room for probes->size ints.
+void array_lower_bound_batch(array *arr, array *probes, int *out){
+    if(arr->type != probes->type){
+        fprintf(stderr,"Array type mismatch\n");
+        return;
+    }
+#define BATCH(NAME, T) array_##NAME##_lower_bound_batch((T const*)arr->data, arr->size, (T const*)probes->data, probes->size, out); return;
+    CARRAY_BSEARCH_DISPATCH(arr, BATCH)
+#undef BATCH
+}
+
+/* Eytzinger Layout */
+// A read-only copy of a sorted array stored in BFS order for cache-friendly lookups.
+// Build one for hot arrays that are searched far more often than they change.
+typedef struct {
+    int size;
+    type_t type;
+    void *data;   // size + 1 slots, slot 0 unused
+} eytzinger;
+
+// This function builds an Eytzinger copy of a sorted array (strings are not copied)
+eytzinger* create_eytzinger(array *arr){
+    eytzinger *e = (eytzinger*)malloc(sizeof(eytzinger));
+    e->size = arr->size;
+    e->type = arr->type;
+    e->data = malloc(((size_t)arr->size + 1) * array_element_size(arr->type));
+#define FILL(NAME, T) array_##NAME##_eytzinger_fill((T*)e->data, (T const*)arr->data, arr->size, 0, 1); break;
+    CARRAY_BSEARCH_DISPATCH(arr, FILL)
+#undef FILL
+    return e;
+}
+
+void free_eytzinger(eytzinger *e){
+    free(e->data);
+    free(e);
+}
+
+// This function returns a pointer to the smallest element not less than value, or NULL
+void* eytzinger_lower_bound(eytzinger *e, void *value){
+    int k = 0;
+#define EYTZ(NAME, T) k = array_##NAME##_eytzinger_lower_bound((T const*)e->data, e->size, *(T const*)value); \
+    return k ? (T*)e->data + k : NULL;
+    CARRAY_BSEARCH_DISPATCH(e, EYTZ)
+#undef EYTZ
+    return NULL;
+}
+
+// This function returns 1 if value is present, else 0
+int eytzinger_contains(eytzinger *e, void *value){
+    void *found = eytzinger_lower_bound(e, value);
+    if(found == NULL) return 0;
+    switch(e->type){
+        case TYPE_INT:    return *(int*)found == *(int*)value;
+        case TYPE_FLOAT:  return *(float*)found == *(float*)value;
+        case TYPE_DOUBLE: return *(double*)found == *(double*)value;
+        case TYPE_CHAR:   return *(char*)found == *(char*)value;
+        case TYPE_STRING: return strcmp(*(char**)found, *(char**)value) == 0;
+    }
+    return 0;
 }
 
 #endif
\ No newline at end of file
@@ -1,12 +1,27 @@
 #ifndef CIO_H
 #define CIO_H
 
+// The mapping functions need POSIX declarations that strict -std=c99/c11 hide
+#if defined(__STRICT_ANSI__) && !defined(_WIN32) && !defined(_POSIX_C_SOURCE) \
+    && !defined(_XOPEN_SOURCE) && !defined(_GNU_SOURCE) && !defined(_DEFAULT_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <stdint.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#if !defined(S_ISREG) && defined(_S_IFMT)
+#define S_ISREG(m) (((m) & _S_IFMT) == _S_IFREG)
+#endif
 
 
 char *cio_input(const char *format, ...) {
@@ -43,23 +58,307 @@ bool file_exists(const char* path) {
     return (stat(path, &buffer) == 0);
 }
 
+// Reads f to EOF into a NUL-terminated heap buffer and stores the byte count in *len.
+// size_hint (0 if unknown) only sets the first allocation: pipes and special files
+// report no size, and a file can grow while it is read. Returns NULL on a read error.
+static char* cio_read_stream(FILE* f, size_t size_hint, size_t* len_out) {
+    size_t cap = size_hint > 0 ? size_hint + 1 : 4096;
+    char* buffer = malloc(cap);
+    size_t len = 0;
+    while (buffer) {
+        len += fread(buffer + len, 1, cap - 1 - len, f);
+        if (len < cap - 1) {
+            if (feof(f) || ferror(f)) break;
+            continue;
+        }
+        // Buffer full: only grow if there really is more data
+        int c = fgetc(f);
+        if (c == EOF) break;
+        char* grown = realloc(buffer, cap * 2);
+        if (!grown) {
+            free(buffer);
+            buffer = NULL;
+            break;
+        }
+        buffer = grown;
+        cap *= 2;
+        buffer[len++] = (char)c;
+    }
+    if (buffer && ferror(f)) {
+        free(buffer);
+        buffer = NULL;
+    }
+    if (buffer) buffer[len] = '\0';
+    if (len_out) *len_out = buffer ? len : 0;
+    return buffer;
+}
+
 char* read_file(const char* filename) {
     FILE* f = fopen(filename, "rb");
     if (!f) return NULL;
 
-    fseek(f, 0, SEEK_END);
-    long length = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    char* buffer = malloc(length + 1);
-    if (buffer) {
-        fread(buffer, 1, length, f);
-        buffer[length] = '\0';
+    // Only a regular file has a meaningful size (a directory's ftell is garbage)
+    size_t hint = 0;
+    struct stat st;
+    if (stat(filename, &st) == 0 && S_ISREG(st.st_mode) && fseek(f, 0, SEEK_END) == 0) {
+        long length = ftell(f);
+        if (length > 0) hint = (size_t)length;
+        fseek(f, 0, SEEK_SET);
     }
+    char* buffer = cio_read_stream(f, hint, NULL);
     fclose(f);
     return buffer;
 }
 
+/* Streaming reader
+ * Reads a file (or any FILE*, including pipes) through one reusable buffer
+ * instead of loading it whole. Chunks and lines are returned as views into that
+ * buffer: they are not NUL-terminated and stay valid only until the next call on
+ * the same reader. A line longer than the buffer makes the buffer grow to fit. */
+#define CIO_READER_DEFAULT_BUFFER (64 * 1024)
+
+typedef struct {
+    const char *data;
+    size_t len;
+} cio_view;
+
+typedef struct {
+    FILE *f;
+    int owns_file;      // opened by cio_reader_open, so closed by cio_reader_close
+    char *buf;
+    size_t cap;
+    size_t start;       // first byte not yet returned
+    size_t end;         // one past the last byte read
+    int eof;
+    int error;          // a line could not fit because the buffer failed to grow
+} cio_reader;
+
+// Wraps an open stream. buffer_size 0 selects CIO_READER_DEFAULT_BUFFER.
+cio_reader* cio_reader_from_file(FILE *f, size_t buffer_size) {
+    if (!f) return NULL;
+    cio_reader *r = (cio_reader*)malloc(sizeof(cio_reader));
+    if (!r) return NULL;
+    r->cap = buffer_size ? buffer_size : CIO_READER_DEFAULT_BUFFER;
+    r->buf = (char*)malloc(r->cap);
+    if (!r->buf) {
+        free(r);
+        return NULL;
+    }
+    r->f = f;
+    r->owns_file = 0;
+    r->start = r->end = 0;
+    r->eof = 0;
+    r->error = 0;
+    return r;
+}
+
+// Opens path for streaming. Returns NULL if it cannot be opened.
+cio_reader* cio_reader_open(const char *path, size_t buffer_size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    cio_reader *r = cio_reader_from_file(f, buffer_size);
+    if (!r) {
+        fclose(f);
+        return NULL;
+    }
+    r->owns_file = 1;
+    return r;
+}
+
+void cio_reader_close(cio_reader *r) {
+    if (!r) return;
+    if (r->owns_file) fclose(r->f);
+    free(r->buf);
+    free(r);
+}
+
+// Returns true if the underlying stream reported a read error, or if reading
+// stopped early because the buffer could not grow to hold a long line
+bool cio_reader_error(cio_reader *r) {
+    return r->error || ferror(r->f) != 0;
+}
+
+// Moves unread bytes to the front and reads until the buffer is full or the
+// stream ends (fread may return short counts on pipes and terminals)
+static void cio_reader_fill(cio_reader *r) {
+    if (r->start > 0) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    while (!r->eof && r->end < r->cap) {
+        size_t n = fread(r->buf + r->end, 1, r->cap - r->end, r->f);
+        r->end += n;
+        if (n == 0 && (feof(r->f) || ferror(r->f))) r->eof = 1;
+    }
+}
+
+// Returns the next block of up to the buffer size in *out (false at end of input)
+bool cio_reader_next_chunk(cio_reader *r, cio_view *out) {
+    if (r->start == r->end) {
+        r->start = r->end = 0;
+        cio_reader_fill(r);
+        if (r->end == 0) return false;
+    }
+    out->data = r->buf + r->start;
+    out->len = r->end - r->start;
+    r->start = r->end;
+    return true;
+}
+
+// Returns the next line in *line without its "\n" or "\r\n" (false at end of input,
+// or on failure: see cio_reader_error). A final line without a newline is still returned.
+bool cio_reader_next_line(cio_reader *r, cio_view *line) {
+    size_t scanned = 0;
+    for (;;) {
+        char *from = r->buf + r->start + scanned;
+        char *nl = (char*)memchr(from, '\n', r->end - r->start - scanned);
+        if (nl) {
+            line->data = r->buf + r->start;
+            line->len = (size_t)(nl - line->data);
+            r->start += line->len + 1;
+            if (line->len > 0 && line->data[line->len - 1] == '\r') line->len--;
+            return true;
+        }
+        if (r->eof) {
+            if (r->start == r->end) return false;
+            line->data = r->buf + r->start;
+            line->len = r->end - r->start;
+            r->start = r->end;
+            if (line->len > 0 && line->data[line->len - 1] == '\r') line->len--;
+            return true;
+        }
+        scanned = r->end - r->start;
+        if (r->start == 0 && r->end == r->cap) {
+            char *grown = (char*)realloc(r->buf, r->cap * 2);
+            if (!grown) {
+                r->error = 1;
+                return false;
+            }
+            r->buf = grown;
+            r->cap *= 2;
+        }
+        cio_reader_fill(r);
+    }
+}
+
+/* Memory-mapped files
+ * cio_map_file returns a read-only view of a whole file without copying it: pages
+ * are loaded by the kernel as they are touched and shared with the page cache.
+ * The view is NOT NUL-terminated, so pass it to the length-taking string
+ * functions (str_count_n, str_split_n in cstring.h). When a file cannot be
+ * mapped (pipes, some special files, Windows) it is read through stdio into the
+ * heap instead and the same pointer/length contract holds. Always release with
+ * cio_unmap. */
+#define CIO_ADVISE_NORMAL 0
+#define CIO_ADVISE_SEQUENTIAL 1     // read-ahead aggressively, drop pages behind
+#define CIO_ADVISE_WILLNEED 2       // start reading the whole file now
+#define CIO_ADVISE_HUGEPAGE 4       // back the mapping with huge pages where supported
+
+static const char cio_empty_view[1] = "";
+
+#ifndef _WIN32
+// cio_unmap tells a heap view from a mapping by its address: mappings start on a
+// page boundary, heap views never do and keep their malloc block just in front.
+#define CIO_HEAP_VIEW_OFFSET 16
+
+static inline bool cio_is_heap_view(const char* data) {
+    return (uintptr_t)data % (uintptr_t)sysconf(_SC_PAGESIZE) != 0;
+}
+#endif
+
+// Loads a file that could not be mapped into heap memory that cio_unmap can release
+static const char* cio_map_fallback(const char* path, size_t* len) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+    size_t n = 0;
+    char* data = cio_read_stream(f, 0, &n);
+    fclose(f);
+    if (!data) return NULL;
+    if (n == 0) {
+        free(data);
+        *len = 0;
+        return cio_empty_view;
+    }
+#ifndef _WIN32
+    char* base = (char*)malloc(n + 2 * CIO_HEAP_VIEW_OFFSET);
+    if (!base) {
+        free(data);
+        return NULL;
+    }
+    char* view = base + CIO_HEAP_VIEW_OFFSET;
+    if (!cio_is_heap_view(view)) view += CIO_HEAP_VIEW_OFFSET;
+    memcpy(view - sizeof(char*), &base, sizeof(char*));
+    memcpy(view, data, n);
+    free(data);
+    data = view;
+#endif
+    *len = n;
+    return data;
+}
+
+// Maps path read-only with the given CIO_ADVISE_* hints. Stores the size in *len
+// and returns the view, or NULL if the file cannot be read.
+const char* cio_map_file_advise(const char* path, size_t* len, int advice) {
+    *len = 0;
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || S_ISDIR(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    // Pipes, devices and files that report no size (e.g. under /proc) are read instead
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return cio_map_fallback(path, len);
+    }
+    size_t n = (size_t)st.st_size;
+    void* data = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return cio_map_fallback(path, len);
+    // Hints only tune paging; a kernel that rejects one still gives a valid view
+#ifdef POSIX_MADV_SEQUENTIAL
+    if (advice & CIO_ADVISE_SEQUENTIAL) posix_madvise(data, n, POSIX_MADV_SEQUENTIAL);
+#endif
+#ifdef POSIX_MADV_WILLNEED
+    if (advice & CIO_ADVISE_WILLNEED) posix_madvise(data, n, POSIX_MADV_WILLNEED);
+#endif
+#ifdef MADV_HUGEPAGE
+    if (advice & CIO_ADVISE_HUGEPAGE) madvise(data, n, MADV_HUGEPAGE);
+#endif
+    (void)advice;
+    *len = n;
+    return (const char*)data;
+#else
+    (void)advice;
+    return cio_map_fallback(path, len);
+#endif
+}
+
+// Maps path read-only for a front-to-back scan (sequential + willneed hints)
+const char* cio_map_file(const char* path, size_t* len) {
+    return cio_map_file_advise(path, len, CIO_ADVISE_SEQUENTIAL | CIO_ADVISE_WILLNEED);
+}
+
+// Releases a view returned by cio_map_file / cio_map_file_advise
+void cio_unmap(const char* data, size_t len) {
+    if (!data || data == cio_empty_view) return;
+#ifndef _WIN32
+    if (cio_is_heap_view(data)) {
+        char* base;
+        memcpy(&base, data - sizeof(char*), sizeof(char*));
+        free(base);
+        return;
+    }
+    munmap((void*)data, len);
+#else
+    (void)len;
+    free((void*)data);
+#endif
+}
+
 void write_file(const char* filename, const char* format, ...) {
     FILE* f = fopen(filename, "wb");
     if (f) {
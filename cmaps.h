@@ -1,60 +1,830 @@
+#ifndef CMAPS_H
+#define CMAPS_H
+
+// chashmap needs the POSIX reader-writer locks, which strict -std=c99/c11 hide.
+// Define CMAPS_NO_CHASHMAP to leave the concurrent map (and pthreads) out; it is
+// also left out when the locks are still hidden (cmaps.h included after a system
+// header in strict mode), so the plain hashmap always builds.
+#if !defined(CMAPS_NO_CHASHMAP) && defined(__STRICT_ANSI__) && !defined(_WIN32) \
+    && !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE) && !defined(_GNU_SOURCE) && !defined(_DEFAULT_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#ifndef CMAPS_NO_CHASHMAP
+#include <pthread.h>
+#ifndef PTHREAD_RWLOCK_INITIALIZER
+#define CMAPS_NO_CHASHMAP
+#endif
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CMAPS_SSE2 1
+#endif
+
+/* Open addressing layout (Swiss table style)
+ * Slots are split into groups of 16. Each slot has one control byte: EMPTY,
+ * DELETED, or the low 7 bits of the key's hash (its fingerprint). A lookup
+ * compares the fingerprint against a whole group of control bytes at once and
+ * only compares keys on the slots that match. */
+#define HASHMAP_GROUP 16
+#define CTRL_EMPTY ((signed char)-128)
+#define CTRL_DELETED ((signed char)-2)
 
 typedef struct Entry {
-    char *key;
+    char *key;          // NUL-terminated copy of the key
     void *value;
-    struct Entry *next;
+    uint64_t hash;      // full hash, compared before the key bytes and reused on rehash
+    size_t len;         // key length in bytes
 } Entry;
 
+/* Key arena
+ * An optional bump allocator for keys: each key is carved out of a large block and
+ * all blocks are released together when the map is freed. */
+#define CMAPS_ARENA_BLOCK 65536
+
+typedef struct cmaps_arena {
+    struct cmaps_arena *next;
+    size_t used;
+    size_t cap;
+    char data[];
+} cmaps_arena;
+
 typedef struct {
-    int size;
-    Entry **buckets;
+    int size;           // number of slots, a power of two and a multiple of HASHMAP_GROUP
+    int count;          // live entries
+    int tombstones;     // DELETED slots, counted towards the load factor
+    signed char *ctrl;  // one control byte per slot
+    Entry *entries;
+    uint64_t seed;      // per-map hash seed
+    cmaps_arena *arena; // key storage when created with create_hashmap_arena, else NULL
+    const char *image;  // read-only mapped image from hashmap_open, else NULL
+    size_t image_len;
 } hashmap;
 
-static unsigned int hash(const char *key, int size) {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *key++)) {
-        hash = (hash * 33) + c;
+/* Hashing
+ * A wyhash-style function: the key is consumed 8 or 16 bytes at a time and each
+ * block is mixed with a 64x64->128 bit multiply. The seed is random per map by
+ * default, so an attacker cannot precompute colliding keys. */
+#define CMAPS_SECRET0 0xa0761d6478bd642fULL
+#define CMAPS_SECRET1 0xe7037ed1a0b428dbULL
+#define CMAPS_SECRET2 0x8ebc6af09c88c6e3ULL
+#define CMAPS_SECRET3 0x589965cc75cf2d59ULL
+
+// Full 128-bit product of a and b, returned as (low, high) in place
+static inline void cmaps_mum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t cmaps_mix(uint64_t a, uint64_t b) {
+    cmaps_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t cmaps_read64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t cmaps_read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+// Hashes len bytes of key with the given seed
+uint64_t cmaps_hash(const void *key, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t*)key;
+    uint64_t a, b;
+    seed ^= cmaps_mix(seed ^ CMAPS_SECRET0, CMAPS_SECRET1);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (cmaps_read32(p) << 32) | cmaps_read32(p + ((len >> 3) << 2));
+            b = (cmaps_read32(p + len - 4) << 32) | cmaps_read32(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = cmaps_mix(cmaps_read64(p) ^ CMAPS_SECRET1, cmaps_read64(p + 8) ^ seed);
+                see1 = cmaps_mix(cmaps_read64(p + 16) ^ CMAPS_SECRET2, cmaps_read64(p + 24) ^ see1);
+                see2 = cmaps_mix(cmaps_read64(p + 32) ^ CMAPS_SECRET3, cmaps_read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = cmaps_mix(cmaps_read64(p) ^ CMAPS_SECRET1, cmaps_read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = cmaps_read64(p + i - 16);
+        b = cmaps_read64(p + i - 8);
+    }
+    a ^= CMAPS_SECRET1;
+    b ^= seed;
+    cmaps_mum(&a, &b);
+    return cmaps_mix(a ^ CMAPS_SECRET0 ^ len, b ^ CMAPS_SECRET1);
+}
+
+// Returns a bitmask with bit i set when ctrl[i] == b, for the 16 bytes of a group
+static inline unsigned int group_match(const signed char *ctrl, signed char b) {
+#ifdef CMAPS_SSE2
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(b)));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < HASHMAP_GROUP; i++) {
+        if (ctrl[i] == b) mask |= 1u << i;
     }
-    return hash % size;
+    return mask;
+#endif
 }
 
-hashmap* create_hashmap(int size) {
+static inline int lowest_bit(unsigned int mask) {
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) { mask >>= 1; i++; }
+    return i;
+#endif
+}
+
+static hashmap* hashmap_alloc(int slots, uint64_t seed) {
     hashmap *map = (hashmap*) malloc(sizeof(hashmap));
-    map->size = size;
-    map->buckets = (Entry**) calloc(size, sizeof(Entry*));
+    map->seed = seed;
+    map->size = slots;
+    map->count = 0;
+    map->tombstones = 0;
+    map->arena = NULL;
+    map->image = NULL;
+    map->image_len = 0;
+    map->ctrl = (signed char*) malloc(slots);
+    memset(map->ctrl, CTRL_EMPTY, slots);
+    map->entries = (Entry*) malloc(slots * sizeof(Entry));
+    return map;
+}
+
+// Returns the slot holding key, or -1. If free_slot is given it receives the first
+// EMPTY or DELETED slot seen on the probe sequence, so an insert needs no second probe.
+static int hashmap_find_slot(hashmap *map, const char *key, size_t len, uint64_t h, int *free_slot) {
+    int groups = map->size / HASHMAP_GROUP;
+    int pos = (int)((h >> 7) & (groups - 1));
+    signed char fp = (signed char)(h & 0x7F);
+    if (free_slot) *free_slot = -1;
+    for (int step = 1; step <= groups; step++) {
+        const signed char *ctrl = map->ctrl + pos * HASHMAP_GROUP;
+        unsigned int mask = group_match(ctrl, fp);
+        while (mask) {
+            Entry *e = &map->entries[pos * HASHMAP_GROUP + lowest_bit(mask)];
+            if (e->hash == h && e->len == len && memcmp(e->key, key, len) == 0) {
+                return (int)(e - map->entries);
+            }
+            mask &= mask - 1;
+        }
+        unsigned int empty = group_match(ctrl, CTRL_EMPTY);
+        if (free_slot && *free_slot < 0) {
+            unsigned int open = empty | group_match(ctrl, CTRL_DELETED);
+            if (open) *free_slot = pos * HASHMAP_GROUP + lowest_bit(open);
+        }
+        if (empty) return -1;
+        pos = (pos + step) & (groups - 1);
+    }
+    return -1;
+}
+
+// Returns the first EMPTY or DELETED slot on the probe sequence of h
+static int hashmap_free_slot(hashmap *map, uint64_t h) {
+    int groups = map->size / HASHMAP_GROUP;
+    int pos = (int)((h >> 7) & (groups - 1));
+    for (int step = 1; ; step++) {
+        const signed char *ctrl = map->ctrl + pos * HASHMAP_GROUP;
+        unsigned int mask = group_match(ctrl, CTRL_EMPTY) | group_match(ctrl, CTRL_DELETED);
+        if (mask) return pos * HASHMAP_GROUP + lowest_bit(mask);
+        pos = (pos + step) & (groups - 1);
+    }
+}
+
+// Moves every entry into a table with the given number of slots (keys are not copied)
+static void hashmap_rehash(hashmap *map, int slots) {
+    hashmap *fresh = hashmap_alloc(slots, map->seed);
+    for (int i = 0; i < map->size; i++) {
+        if (map->ctrl[i] < 0) continue;
+        uint64_t h = map->entries[i].hash;
+        int slot = hashmap_free_slot(fresh, h);
+        fresh->ctrl[slot] = (signed char)(h & 0x7F);
+        fresh->entries[slot] = map->entries[i];
+    }
+    free(map->ctrl);
+    free(map->entries);
+    map->size = fresh->size;
+    map->ctrl = fresh->ctrl;
+    map->entries = fresh->entries;
+    map->tombstones = 0;
+    free(fresh);
+}
+
+// Makes room for one more entry, keeping the load (including tombstones) at or below 7/8.
+// Returns 1 if the table was rehashed, which moves every entry.
+static int hashmap_reserve_one(hashmap *map) {
+    if ((map->count + map->tombstones + 1) <= map->size / 8 * 7) return 0;
+    int slots = map->size;
+    if (map->count + 1 > slots / 2) slots *= 2;
+    hashmap_rehash(map, slots);
+    return 1;
+}
+
+static cmaps_arena* arena_block(cmaps_arena *next, size_t cap) {
+    if (cap < CMAPS_ARENA_BLOCK) cap = CMAPS_ARENA_BLOCK;
+    cmaps_arena *block = (cmaps_arena*) malloc(sizeof(cmaps_arena) + cap);
+    block->next = next;
+    block->used = 0;
+    block->cap = cap;
+    return block;
+}
+
+// Returns n bytes from the arena, starting a new block when the current one is full
+static char* arena_alloc(cmaps_arena **head, size_t n) {
+    cmaps_arena *block = *head;
+    if (block->used + n > block->cap) {
+        block = arena_block(block, n);
+        *head = block;
+    }
+    char *p = block->data + block->used;
+    block->used += n;
+    return p;
+}
+
+static void arena_free(cmaps_arena *block) {
+    while (block) {
+        cmaps_arena *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+// Fills a free slot with a copy of the key
+static Entry* hashmap_insert_at(hashmap *map, int slot, const char *key, size_t len, uint64_t h, void *value) {
+    if (map->ctrl[slot] == CTRL_DELETED) map->tombstones--;
+    map->ctrl[slot] = (signed char)(h & 0x7F);
+    Entry *e = &map->entries[slot];
+    e->key = map->arena ? arena_alloc(&map->arena, len + 1) : (char*) malloc(len + 1);
+    memcpy(e->key, key, len);
+    e->key[len] = '\0';
+    e->len = len;
+    e->value = value;
+    e->hash = h;
+    map->count++;
+    return e;
+}
+
+// Creates a map sized to hold `size` entries without rehashing, using the given hash seed
+hashmap* create_hashmap_seeded(int size, uint64_t seed) {
+    int slots = HASHMAP_GROUP;
+    while (slots / 8 * 7 < size) slots *= 2;
+    return hashmap_alloc(slots, seed);
+}
+
+// Creates a map sized to hold `size` entries without rehashing. It still grows automatically.
+hashmap* create_hashmap(int size) {
+    static uint64_t counter = 0;
+#if defined(__GNUC__)
+    uint64_t n = __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+#else
+    uint64_t n = ++counter;
+#endif
+    uint64_t seed = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)&counter ^ (n * CMAPS_SECRET2);
+    return create_hashmap_seeded(size, cmaps_mix(seed, CMAPS_SECRET3));
+}
+
+// Creates a map whose keys are stored in an arena instead of one malloc per key.
+// Removing a key does not give its bytes back; they are released by hashmap_free.
+hashmap* create_hashmap_arena(int size) {
+    hashmap *map = create_hashmap(size);
+    map->arena = arena_block(NULL, CMAPS_ARENA_BLOCK);
     return map;
 }
 
+// Frees the map and every key. If free_value is not NULL it is called on each value.
+static void hashmap_image_close(hashmap *map);
+
+void hashmap_free(hashmap *map, void (*free_value)(void*)) {
+    if (map == NULL) return;
+    if (map->image) {
+        hashmap_image_close(map);
+        return;
+    }
+    for (int i = 0; i < map->size; i++) {
+        if (map->ctrl[i] < 0) continue;
+        if (free_value) free_value(map->entries[i].value);
+        if (map->arena == NULL) free(map->entries[i].key);
+    }
+    arena_free(map->arena);
+    free(map->ctrl);
+    free(map->entries);
+    free(map);
+}
+
+// Returns the number of entries in the map
+int hashmap_count(hashmap *map) {
+    return map->count;
+}
+
+/* Length-delimited keys
+ * The _n functions take a key as (pointer, length), so slices of a larger buffer
+ * can be used without copying. The key may contain NUL bytes. */
+
+static void hashmap_put_hashed(hashmap *map, const char *key, size_t len, uint64_t h, void *value) {
+    int slot = hashmap_find_slot(map, key, len, h, NULL);
+    if (slot >= 0) {
+        map->entries[slot].value = value;
+        return;
+    }
+    hashmap_reserve_one(map);
+    hashmap_insert_at(map, hashmap_free_slot(map, h), key, len, h, value);
+}
+
+static void* hashmap_remove_hashed(hashmap *map, const char *key, size_t len, uint64_t h) {
+    int slot = hashmap_find_slot(map, key, len, h, NULL);
+    if (slot < 0) return NULL;
+    void *value = map->entries[slot].value;
+    // Arena keys stay allocated until the map is freed
+    if (map->arena == NULL) free(map->entries[slot].key);
+    // A group that still has an EMPTY slot never made a probe move on, so the slot
+    // can go straight back to EMPTY; otherwise leave a tombstone.
+    const signed char *group = map->ctrl + slot / HASHMAP_GROUP * HASHMAP_GROUP;
+    if (group_match(group, CTRL_EMPTY)) {
+        map->ctrl[slot] = CTRL_EMPTY;
+    } else {
+        map->ctrl[slot] = CTRL_DELETED;
+        map->tombstones++;
+    }
+    map->count--;
+    return value;
+}
+
+static void* hashmap_image_get(hashmap *map, const char *key, size_t len);
+static void hashmap_image_entry(hashmap *map, int slot, const char **key, size_t *len, void **value);
+
+#define HASHMAP_CHECK_WRITABLE(map, ret)                                   \
+    if ((map)->image) {                                                    \
+        fprintf(stderr, "Hashmap is read-only\n");                         \
+        return ret;                                                        \
+    }
+
+void hashmap_put_n(hashmap *map, const char *key, size_t len, void *value) {
+    HASHMAP_CHECK_WRITABLE(map, )
+    hashmap_put_hashed(map, key, len, cmaps_hash(key, len, map->seed), value);
+}
+
+void* hashmap_get_n(hashmap *map, const char *key, size_t len) {
+    if (map->image) return hashmap_image_get(map, key, len);
+    int slot = hashmap_find_slot(map, key, len, cmaps_hash(key, len, map->seed), NULL);
+    return slot >= 0 ? map->entries[slot].value : NULL;
+}
+
+// Removes key from the map and returns its value, or NULL if it was not present
+void* hashmap_remove_n(hashmap *map, const char *key, size_t len) {
+    HASHMAP_CHECK_WRITABLE(map, NULL)
+    return hashmap_remove_hashed(map, key, len, cmaps_hash(key, len, map->seed));
+}
+
+// Returns a pointer to the value stored for key, inserting value first if the key is
+// missing. *inserted (if not NULL) tells which case happened. Lookup and insert share
+// one probe, and a hit never resizes the map. The pointer is valid until the next
+// insert or remove.
+void** hashmap_get_or_insert_n(hashmap *map, const char *key, size_t len, void *value, int *inserted) {
+    HASHMAP_CHECK_WRITABLE(map, NULL)
+    uint64_t h = cmaps_hash(key, len, map->seed);
+    int free_slot;
+    int slot = hashmap_find_slot(map, key, len, h, &free_slot);
+    if (inserted) *inserted = slot < 0;
+    if (slot >= 0) return &map->entries[slot].value;
+    // Only a miss may grow the table; a rehash moves the slot found by the probe
+    if (hashmap_reserve_one(map) || free_slot < 0) free_slot = hashmap_free_slot(map, h);
+    return &hashmap_insert_at(map, free_slot, key, len, h, value)->value;
+}
+
+/* NUL-terminated keys */
+
 void hashmap_put(hashmap *map, const char *key, void *value) {
-    unsigned int slot = hash(key, map->size);
-    Entry *entry = map->buckets[slot];
+    hashmap_put_n(map, key, strlen(key), value);
+}
 
-    while (entry != NULL) {
-        if (strcmp(entry->key, key) == 0) {
-            entry->value = value;
-            return;
+void* hashmap_get(hashmap *map, const char *key) {
+    return hashmap_get_n(map, key, strlen(key));
+}
+
+void* hashmap_remove(hashmap *map, const char *key) {
+    return hashmap_remove_n(map, key, strlen(key));
+}
+
+void** hashmap_get_or_insert(hashmap *map, const char *key, void *value, int *inserted) {
+    return hashmap_get_or_insert_n(map, key, strlen(key), value, inserted);
+}
+
+// Builds an arena-backed map from n keys and values in one go. The table is sized
+// for n up front and all keys go into a single arena block, so there is no rehash
+// and one key allocation in total. Later duplicates overwrite earlier ones.
+hashmap* hashmap_build_from(const char **keys, void **values, int n) {
+    hashmap *map = create_hashmap(n);
+    size_t total = 0;
+    for (int i = 0; i < n; i++) total += strlen(keys[i]) + 1;
+    map->arena = arena_block(NULL, total);
+    for (int i = 0; i < n; i++) hashmap_put(map, keys[i], values ? values[i] : NULL);
+    return map;
+}
+
+/* Iteration
+ * Start with *cursor = 0 and call hashmap_next until it returns 0. Entries come out
+ * in table order. The map must not be modified while iterating, except through
+ * *value. hashmap_next_n also returns the key length, for keys stored with the _n
+ * functions that may contain NUL bytes; keys are always NUL-terminated as well. */
+int hashmap_next_n(hashmap *map, int *cursor, const char **key, size_t *len, void **value) {
+    for (int i = *cursor; i < map->size; i++) {
+        if (map->ctrl[i] < 0) continue;
+        if (map->image) {
+            hashmap_image_entry(map, i, key, len, value);
+        } else {
+            if (key) *key = map->entries[i].key;
+            if (len) *len = map->entries[i].len;
+            if (value) *value = map->entries[i].value;
         }
-        entry = entry->next;
+        *cursor = i + 1;
+        return 1;
     }
+    *cursor = map->size;
+    return 0;
+}
 
-    Entry *new_entry = (Entry*) malloc(sizeof(Entry));
-    new_entry->key = strdup(key);
-    new_entry->value = value;
-    new_entry->next = map->buckets[slot];
-    map->buckets[slot] = new_entry;
+int hashmap_next(hashmap *map, int *cursor, const char **key, void **value) {
+    return hashmap_next_n(map, cursor, key, NULL, value);
 }
 
-void* hashmap_get(hashmap *map, const char *key) {
-    unsigned int slot = hash(key, map->size);
-    Entry *entry = map->buckets[slot];
+/* Persisted images
+ * hashmap_save writes a map to a file that hashmap_open maps back read-only with
+ * no parsing. The file keeps the Swiss table layout with offsets instead of
+ * pointers:
+ *   header | control bytes (one per slot) | slot records | key and value bytes
+ * All offsets are from the start of the file. Every value starts on a
+ * CMAPS_IMAGE_ALIGN boundary, so a saved int, double or struct can be read
+ * straight through the pointer hashmap_get returns. The image uses the host's
+ * byte order and is meant to be read on the machine type that wrote it. */
+#define CMAPS_IMAGE_MAGIC "CMAPIMG1"
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define CMAPS_IMAGE_ALIGN _Alignof(max_align_t)
+#else
+#define CMAPS_IMAGE_ALIGN 16
+#endif
+
+typedef struct {
+    char magic[8];
+    uint64_t seed;
+    uint64_t slots;
+    uint64_t count;
+    uint64_t ctrl_off;
+    uint64_t slots_off;
+    uint64_t file_size;
+} cmaps_image_header;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t key_off;
+    uint64_t key_len;
+    uint64_t val_off;   // 0 for a NULL value
+    uint64_t val_len;
+} cmaps_image_slot;
 
-    while (entry != NULL) {
-        if (strcmp(entry->key, key) == 0) return entry->value;
-        entry = entry->next;
+static inline const cmaps_image_slot* hashmap_image_slots(hashmap *map) {
+    const cmaps_image_header *hdr = (const cmaps_image_header*) map->image;
+    return (const cmaps_image_slot*) (map->image + hdr->slots_off);
+}
+
+static void* hashmap_image_get(hashmap *map, const char *key, size_t len) {
+    const cmaps_image_slot *records = hashmap_image_slots(map);
+    uint64_t h = cmaps_hash(key, len, map->seed);
+    int groups = map->size / HASHMAP_GROUP;
+    int pos = (int)((h >> 7) & (groups - 1));
+    signed char fp = (signed char)(h & 0x7F);
+    for (int step = 1; step <= groups; step++) {
+        const signed char *ctrl = map->ctrl + pos * HASHMAP_GROUP;
+        unsigned int mask = group_match(ctrl, fp);
+        while (mask) {
+            const cmaps_image_slot *r = &records[pos * HASHMAP_GROUP + lowest_bit(mask)];
+            if (r->hash == h && r->key_len == len && memcmp(map->image + r->key_off, key, len) == 0) {
+                return r->val_off ? (void*)(map->image + r->val_off) : NULL;
+            }
+            mask &= mask - 1;
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) return NULL;
+        pos = (pos + step) & (groups - 1);
     }
     return NULL;
-}
\ No newline at end of file
+}
+
+static void hashmap_image_entry(hashmap *map, int slot, const char **key, size_t *len, void **value) {
+    const cmaps_image_slot *r = &hashmap_image_slots(map)[slot];
+    if (key) *key = map->image + r->key_off;
+    if (len) *len = (size_t) r->key_len;
+    if (value) *value = r->val_off ? (void*)(map->image + r->val_off) : NULL;
+}
+
+static void hashmap_image_close(hashmap *map) {
+#ifndef _WIN32
+    munmap((void*) map->image, map->image_len);
+#else
+    free((void*) map->image);
+#endif
+    free(map);
+}
+
+// Writes map to path. value_size returns the number of bytes to store for a value;
+// pass NULL to store values as NUL-terminated strings. A map from hashmap_open is
+// copied as it is. Returns 1 on success, 0 on error.
+int hashmap_save(hashmap *map, const char *path, size_t (*value_size)(const void *value)) {
+    if (map->image) {
+        FILE *f = fopen(path, "wb");
+        if (f == NULL) return 0;
+        int ok = fwrite(map->image, 1, map->image_len, f) == map->image_len;
+        if (fclose(f) != 0) ok = 0;
+        return ok;
+    }
+
+    // Lay the entries out in a fresh table without tombstones
+    hashmap *layout = create_hashmap_seeded(map->count, map->seed);
+    for (int i = 0; i < map->size; i++) {
+        if (map->ctrl[i] < 0) continue;
+        Entry *e = &map->entries[i];
+        int slot = hashmap_free_slot(layout, e->hash);
+        layout->ctrl[slot] = (signed char)(e->hash & 0x7F);
+        layout->entries[slot] = *e;
+    }
+
+    cmaps_image_header hdr;
+    memcpy(hdr.magic, CMAPS_IMAGE_MAGIC, 8);
+    hdr.seed = map->seed;
+    hdr.slots = layout->size;
+    hdr.count = map->count;
+    hdr.ctrl_off = sizeof(hdr);
+    hdr.slots_off = hdr.ctrl_off + layout->size;
+    uint64_t off = hdr.slots_off + (uint64_t)layout->size * sizeof(cmaps_image_slot);
+
+    cmaps_image_slot *records = (cmaps_image_slot*) calloc(layout->size, sizeof(cmaps_image_slot));
+    for (int i = 0; i < layout->size; i++) {
+        if (layout->ctrl[i] < 0) continue;
+        Entry *e = &layout->entries[i];
+        records[i].hash = e->hash;
+        records[i].key_off = off;
+        records[i].key_len = e->len;
+        off += e->len + 1;
+        if (e->value) {
+            off = (off + CMAPS_IMAGE_ALIGN - 1) / CMAPS_IMAGE_ALIGN * CMAPS_IMAGE_ALIGN;
+            records[i].val_off = off;
+            records[i].val_len = value_size ? value_size(e->value) : strlen((const char*) e->value) + 1;
+            off += records[i].val_len;
+        }
+    }
+    hdr.file_size = off;
+
+    FILE *f = fopen(path, "wb");
+    int ok = f != NULL;
+    if (ok) {
+        static const char zeros[CMAPS_IMAGE_ALIGN] = {0};
+        ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1
+          && fwrite(layout->ctrl, 1, layout->size, f) == (size_t) layout->size
+          && fwrite(records, sizeof(cmaps_image_slot), layout->size, f) == (size_t) layout->size;
+        for (int i = 0; ok && i < layout->size; i++) {
+            if (layout->ctrl[i] < 0) continue;
+            Entry *e = &layout->entries[i];
+            ok = fwrite(e->key, 1, e->len + 1, f) == e->len + 1;
+            if (ok && records[i].val_off) {
+                size_t pad = (size_t)(records[i].val_off - records[i].key_off - e->len - 1);
+                ok = fwrite(zeros, 1, pad, f) == pad
+                  && fwrite(e->value, 1, records[i].val_len, f) == records[i].val_len;
+            }
+        }
+        if (fclose(f) != 0) ok = 0;
+    }
+
+    free(records);
+    free(layout->ctrl);
+    free(layout->entries);
+    free(layout);
+    return ok;
+}
+
+// Checks that every offset and length in an image stays inside its len bytes, so a
+// truncated or corrupted file is rejected instead of read out of bounds
+static int hashmap_image_valid(const char *image, size_t len) {
+    const cmaps_image_header *hdr = (const cmaps_image_header*) image;
+    if (len < sizeof(cmaps_image_header) || memcmp(hdr->magic, CMAPS_IMAGE_MAGIC, 8) != 0
+        || hdr->file_size != len) return 0;
+    // The probe masks with size - 1 and reads whole groups of control bytes
+    uint64_t slots = hdr->slots;
+    if (slots < HASHMAP_GROUP || (slots & (slots - 1)) != 0 || slots > INT_MAX
+        || hdr->count > slots) return 0;
+    if (hdr->ctrl_off > len || slots > len - hdr->ctrl_off) return 0;
+    if (hdr->slots_off % sizeof(uint64_t) != 0 || hdr->slots_off > len
+        || slots > (len - hdr->slots_off) / sizeof(cmaps_image_slot)) return 0;
+
+    const signed char *ctrl = (const signed char*) (image + hdr->ctrl_off);
+    const cmaps_image_slot *records = (const cmaps_image_slot*) (image + hdr->slots_off);
+    uint64_t full = 0;
+    for (uint64_t i = 0; i < slots; i++) {
+        if (ctrl[i] == CTRL_EMPTY || ctrl[i] == CTRL_DELETED) continue;
+        if (ctrl[i] < 0) return 0;
+        const cmaps_image_slot *r = &records[i];
+        if (r->key_off > len || r->key_len >= len - r->key_off
+            || image[r->key_off + r->key_len] != '\0') return 0;
+        if (r->val_off && (r->val_off > len || r->val_len > len - r->val_off)) return 0;
+        full++;
+    }
+    return full == hdr->count;
+}
+
+// Opens an image written by hashmap_save. The result supports hashmap_get(_n),
+// hashmap_next and hashmap_count; values point into the read-only mapping. Writes are
+// rejected. Release it with hashmap_free. Returns NULL if the file is not a valid image.
+// Values are aligned to CMAPS_IMAGE_ALIGN.
+hashmap* hashmap_open(const char *path) {
+    const char *image = NULL;
+    size_t len = 0;
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(cmaps_image_header)) {
+        close(fd);
+        return NULL;
+    }
+    len = (size_t) st.st_size;
+    void *p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    image = (const char*) p;
+#else
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    long end = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    if (end < (long) sizeof(cmaps_image_header) || fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    len = (size_t) end;
+    char *buf = (char*) malloc(len);
+    if (buf == NULL || fread(buf, 1, len, f) != len) {
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    image = buf;
+#endif
+
+    if (!hashmap_image_valid(image, len)) {
+#ifndef _WIN32
+        munmap((void*) image, len);
+#else
+        free((void*) image);
+#endif
+        return NULL;
+    }
+
+    const cmaps_image_header *hdr = (const cmaps_image_header*) image;
+    hashmap *map = (hashmap*) malloc(sizeof(hashmap));
+    map->size = (int) hdr->slots;
+    map->count = (int) hdr->count;
+    map->tombstones = 0;
+    map->ctrl = (signed char*) (image + hdr->ctrl_off);
+    map->entries = NULL;
+    map->seed = hdr->seed;
+    map->arena = NULL;
+    map->image = image;
+    map->image_len = len;
+    return map;
+}
+
+#ifndef CMAPS_NO_CHASHMAP
+/* Concurrent map
+ * chashmap splits the key space over CMAPS_SHARDS independent hashmaps, each
+ * behind its own reader-writer lock. The shard is picked from the top bits of the
+ * key hash, so threads working on different keys rarely touch the same lock, any
+ * number of readers can share a shard, and each shard resizes on its own without
+ * stopping the others. Values are returned by copy, so a get never holds a lock
+ * after it returns. */
+#define CMAPS_SHARD_BITS 6
+#define CMAPS_SHARDS (1 << CMAPS_SHARD_BITS)
+
+typedef struct {
+    pthread_rwlock_t lock;
+    hashmap *map;
+    char pad[64];       // keep neighbouring shard locks on separate cache lines
+} chashmap_shard;
+
+typedef struct {
+    uint64_t seed;
+    chashmap_shard shards[CMAPS_SHARDS];
+} chashmap;
+
+// Creates a concurrent map sized to hold `size` entries before any shard resizes
+chashmap* create_chashmap(int size) {
+    chashmap *m = (chashmap*) malloc(sizeof(chashmap));
+    hashmap *first = create_hashmap(size / CMAPS_SHARDS + 1);
+    m->seed = first->seed;
+    for (int i = 0; i < CMAPS_SHARDS; i++) {
+        pthread_rwlock_init(&m->shards[i].lock, NULL);
+        m->shards[i].map = i == 0 ? first : create_hashmap_seeded(size / CMAPS_SHARDS + 1, m->seed);
+    }
+    return m;
+}
+
+// Frees the map and every key. Must not run concurrently with other calls.
+void chashmap_free(chashmap *m, void (*free_value)(void*)) {
+    for (int i = 0; i < CMAPS_SHARDS; i++) {
+        hashmap_free(m->shards[i].map, free_value);
+        pthread_rwlock_destroy(&m->shards[i].lock);
+    }
+    free(m);
+}
+
+static inline chashmap_shard* chashmap_shard_for(chashmap *m, uint64_t h) {
+    return &m->shards[h >> (64 - CMAPS_SHARD_BITS)];
+}
+
+void chashmap_put_n(chashmap *m, const char *key, size_t len, void *value) {
+    uint64_t h = cmaps_hash(key, len, m->seed);
+    chashmap_shard *s = chashmap_shard_for(m, h);
+    pthread_rwlock_wrlock(&s->lock);
+    hashmap_put_hashed(s->map, key, len, h, value);
+    pthread_rwlock_unlock(&s->lock);
+}
+
+void* chashmap_get_n(chashmap *m, const char *key, size_t len) {
+    uint64_t h = cmaps_hash(key, len, m->seed);
+    chashmap_shard *s = chashmap_shard_for(m, h);
+    pthread_rwlock_rdlock(&s->lock);
+    int slot = hashmap_find_slot(s->map, key, len, h, NULL);
+    void *value = slot >= 0 ? s->map->entries[slot].value : NULL;
+    pthread_rwlock_unlock(&s->lock);
+    return value;
+}
+
+void* chashmap_remove_n(chashmap *m, const char *key, size_t len) {
+    uint64_t h = cmaps_hash(key, len, m->seed);
+    chashmap_shard *s = chashmap_shard_for(m, h);
+    pthread_rwlock_wrlock(&s->lock);
+    void *value = hashmap_remove_hashed(s->map, key, len, h);
+    pthread_rwlock_unlock(&s->lock);
+    return value;
+}
+
+void chashmap_put(chashmap *m, const char *key, void *value) {
+    chashmap_put_n(m, key, strlen(key), value);
+}
+
+void* chashmap_get(chashmap *m, const char *key) {
+    return chashmap_get_n(m, key, strlen(key));
+}
+
+void* chashmap_remove(chashmap *m, const char *key) {
+    return chashmap_remove_n(m, key, strlen(key));
+}
+
+// Returns the number of entries. With concurrent writers this is a snapshot.
+int chashmap_count(chashmap *m) {
+    int count = 0;
+    for (int i = 0; i < CMAPS_SHARDS; i++) {
+        pthread_rwlock_rdlock(&m->shards[i].lock);
+        count += m->shards[i].map->count;
+        pthread_rwlock_unlock(&m->shards[i].lock);
+    }
+    return count;
+}
+#endif // CMAPS_NO_CHASHMAP
+
+#endif
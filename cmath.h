@@ -1,31 +1,110 @@
+#ifndef CMATH_H
+#define CMATH_H
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#include "carray.h"
+#include "crand.h"
+
+/* Matrix storage
+ * All elements live in one 64-byte aligned block. Each row starts `stride` doubles
+ * after the previous one (stride is cols rounded up to a multiple of 8, so every
+ * row is cache-line aligned). `data` is an array of row pointers into that block,
+ * kept so m->data[i][j] still works. Views made with matrix_view, matrix_row_view
+ * and matrix_col_view share the block of their parent instead of copying. */
+#define MATRIX_ALIGN 64
 
 typedef struct {
     int rows;
     int cols;
-    double **data;
+    double **data;      // row pointers into block
+    double *block;      // first element (row 0, column 0)
+    int stride;         // distance between rows, in doubles
+    int owner;          // 1 if this matrix allocated block, 0 for views
 } matrix;
 
-matrix* create_matrix(int rows, int cols) {
+static double* matrix_alloc_block(size_t count) {
+    void *p = NULL;
+    size_t bytes = count * sizeof(double);
+    if (bytes == 0) bytes = MATRIX_ALIGN;
+#ifdef _WIN32
+    p = _aligned_malloc(bytes, MATRIX_ALIGN);
+#else
+    if (posix_memalign(&p, MATRIX_ALIGN, bytes) != 0) p = NULL;
+#endif
+    return (double*)p;
+}
+
+static void matrix_free_block(double *block) {
+#ifdef _WIN32
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
+
+// Builds the matrix header and row pointers over existing storage
+static matrix* matrix_wrap(double *block, int rows, int cols, int stride, int owner) {
     matrix *m = (matrix*)malloc(sizeof(matrix));
     m->rows = rows;
     m->cols = cols;
-    m->data = (double**)malloc(rows * sizeof(double*));
-    for (int i = 0; i < rows; i++) {
-        m->data[i] = (double*)calloc(cols, sizeof(double));
-    }
+    m->block = block;
+    m->stride = stride;
+    m->owner = owner;
+    m->data = (double**)malloc((rows > 0 ? rows : 1) * sizeof(double*));
+    for (int i = 0; i < rows; i++) m->data[i] = block + (size_t)i * stride;
     return m;
 }
 
+matrix* create_matrix(int rows, int cols) {
+    int stride = (cols + 7) & ~7;
+    double *block = matrix_alloc_block((size_t)rows * stride);
+    memset(block, 0, (size_t)rows * stride * sizeof(double));
+    return matrix_wrap(block, rows, cols, stride, 1);
+}
+
+// Frees a matrix or a view. Views must be freed before the matrix they look into.
 void free_matrix(matrix *m) {
-    for (int i = 0; i < m->rows; i++) free(m->data[i]);
+    if (m->owner) matrix_free_block(m->block);
     free(m->data);
     free(m);
 }
 
+// Returns a rows x cols window of m starting at (r0, c0) that shares m's storage
+matrix* matrix_view(matrix *m, int r0, int c0, int rows, int cols) {
+    if (r0 < 0 || c0 < 0 || rows < 0 || cols < 0 || r0 + rows > m->rows || c0 + cols > m->cols) {
+        fprintf(stderr, "Matrix view out of bounds\n");
+        return NULL;
+    }
+    return matrix_wrap(m->block + (size_t)r0 * m->stride + c0, rows, cols, m->stride, 0);
+}
+
+// Returns row i of m as a 1 x cols view
+matrix* matrix_row_view(matrix *m, int i) {
+    return matrix_view(m, i, 0, 1, m->cols);
+}
+
+// Returns column j of m as a rows x 1 view
+matrix* matrix_col_view(matrix *m, int j) {
+    return matrix_view(m, 0, j, m->rows, 1);
+}
+
+// Returns a contiguous copy of m (useful to detach a view from its parent)
+matrix* matrix_copy(matrix *m) {
+    matrix *res = create_matrix(m->rows, m->cols);
+    for (int i = 0; i < m->rows; i++)
+        memcpy(res->data[i], m->data[i], m->cols * sizeof(double));
+    return res;
+}
+
 matrix* matrix_from_input(int rows, int cols) {
     matrix *m = create_matrix(rows, cols);
     for (int i = 0; i < rows; i++) {
@@ -37,50 +116,1143 @@ matrix* matrix_from_input(int rows, int cols) {
     return m;
 }
 
-matrix* matrix_rand(int rows, int cols, int min, int max) {
+// Fills a new matrix with uniform integers in [min, max] drawn from r (NULL uses
+// the calling thread's generator)
+matrix* matrix_rand_rng(int rows, int cols, int min, int max, rng *r) {
+    if (r == NULL) r = rng_thread();
     matrix *m = create_matrix(rows, cols);
+    int *buf = (int*)malloc((cols > 0 ? cols : 1) * sizeof(int));
     for (int i = 0; i < rows; i++) {
-        for (int j = 0; j < cols; j++) {
-            m->data[i][j] = (rand() % (max - min + 1)) + min;
-        }
+        rng_fill_int(r, buf, cols, min, max);
+        for (int j = 0; j < cols; j++) m->data[i][j] = buf[j];
     }
+    free(buf);
     return m;
 }
 
+// Seeded from rand(), so srand() still makes the output repeatable
+matrix* matrix_rand(int rows, int cols, int min, int max) {
+    rng r;
+    rng_seed_from_rand(&r);
+    return matrix_rand_rng(rows, cols, min, max, &r);
+}
+
+/* Threads and SIMD dispatch */
+static int matrix_threads = 0;
+
+// Sets the number of threads used by matrix kernels (0 = one per online CPU)
+void matrix_set_threads(int n) {
+    matrix_threads = n < 0 ? 0 : n;
+}
+
+static int matrix_thread_count(void) {
+    if (matrix_threads > 0) return matrix_threads;
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+/* Thread pool
+ * Worker threads are started on first use and then kept, sleeping on a condition
+ * variable between jobs, so a parallel kernel costs a wakeup rather than a thread
+ * start. A job is `tasks` calls of fn(arg, i); the calling thread runs tasks too.
+ * Only one job runs at a time: a kernel called while the pool is busy (from another
+ * thread, or from inside a task) runs its tasks on the calling thread. */
+#define CMATH_POOL_MAX 64
+
+typedef void (*cmath_task_fn)(void *arg, int index);
+
+static struct {
+    pthread_mutex_t owner;      // held by the thread whose job is running
+    pthread_mutex_t lock;       // protects the fields below
+    pthread_cond_t work, done;
+    int workers;
+    cmath_task_fn fn;
+    void *arg;
+    int tasks, next, pending;
+} cmath_pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                 PTHREAD_COND_INITIALIZER, 0, NULL, NULL, 0, 0, 0 };
+
+static void* cmath_pool_worker(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&cmath_pool.lock);
+    for (;;) {
+        while (cmath_pool.next >= cmath_pool.tasks) pthread_cond_wait(&cmath_pool.work, &cmath_pool.lock);
+        int i = cmath_pool.next++;
+        cmath_task_fn fn = cmath_pool.fn;
+        void *arg = cmath_pool.arg;
+        pthread_mutex_unlock(&cmath_pool.lock);
+        fn(arg, i);
+        pthread_mutex_lock(&cmath_pool.lock);
+        if (--cmath_pool.pending == 0) pthread_cond_signal(&cmath_pool.done);
+    }
+    return NULL;
+}
+
+// Runs fn(arg, i) for i in [0, tasks) on the pool and returns when all are done
+static void cmath_pool_run(int tasks, cmath_task_fn fn, void *arg) {
+    if (tasks <= 1 || pthread_mutex_trylock(&cmath_pool.owner) != 0) {
+        for (int i = 0; i < tasks; i++) fn(arg, i);
+        return;
+    }
+    pthread_mutex_lock(&cmath_pool.lock);
+    while (cmath_pool.workers < tasks - 1 && cmath_pool.workers < CMATH_POOL_MAX - 1) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, cmath_pool_worker, NULL) != 0) break;
+        pthread_detach(tid);
+        cmath_pool.workers++;
+    }
+    cmath_pool.fn = fn;
+    cmath_pool.arg = arg;
+    cmath_pool.tasks = tasks;
+    cmath_pool.next = 0;
+    cmath_pool.pending = tasks;
+    pthread_cond_broadcast(&cmath_pool.work);
+    // Take tasks alongside the workers (all of them if no worker could be started)
+    while (cmath_pool.next < cmath_pool.tasks) {
+        int i = cmath_pool.next++;
+        pthread_mutex_unlock(&cmath_pool.lock);
+        fn(arg, i);
+        pthread_mutex_lock(&cmath_pool.lock);
+        cmath_pool.pending--;
+    }
+    while (cmath_pool.pending > 0) pthread_cond_wait(&cmath_pool.done, &cmath_pool.lock);
+    cmath_pool.tasks = cmath_pool.next = 0;
+    pthread_mutex_unlock(&cmath_pool.lock);
+    pthread_mutex_unlock(&cmath_pool.owner);
+}
+
+// Row-parallel kernels with fewer estimated operations than this run on the calling thread
+#define CMATH_PARALLEL_WORK (1 << 16)
+
+typedef void (*cmath_rows_fn)(void *ctx, int r0, int r1);
+
+typedef struct {
+    cmath_rows_fn fn;
+    void *ctx;
+    int bounds[CMATH_POOL_MAX + 1];
+} cmath_rows_job;
+
+static void cmath_rows_task(void *p, int t) {
+    cmath_rows_job *job = (cmath_rows_job*)p;
+    job->fn(job->ctx, job->bounds[t], job->bounds[t + 1]);
+}
+
+// Runs fn over [0, rows) in per-thread slices. With ptr, slices are balanced by
+// nonzero count instead of row count.
+static void cmath_for_rows(int rows, const int *ptr, double work, cmath_rows_fn fn, void *ctx) {
+    int threads = matrix_thread_count();
+    if (work < CMATH_PARALLEL_WORK) threads = 1;
+    if (threads > rows) threads = rows;
+    if (threads > CMATH_POOL_MAX) threads = CMATH_POOL_MAX;
+    if (threads <= 1) {
+        if (rows > 0) fn(ctx, 0, rows);
+        return;
+    }
+    cmath_rows_job job;
+    job.fn = fn;
+    job.ctx = ctx;
+    job.bounds[0] = 0;
+    int r0 = 0;
+    for (int t = 0; t < threads; t++) {
+        int r1 = rows;
+        if (t < threads - 1) {
+            if (ptr != NULL) {
+                long long target = (long long)ptr[rows] * (t + 1) / threads;
+                int lo = r0, hi = rows;
+                while (lo < hi) {
+                    int mid = lo + (hi - lo) / 2;
+                    if (ptr[mid] < target) lo = mid + 1; else hi = mid;
+                }
+                r1 = lo;
+            } else {
+                r1 = (int)((long long)rows * (t + 1) / threads);
+            }
+        }
+        job.bounds[t + 1] = r1;
+        r0 = r1;
+    }
+    cmath_pool_run(threads, cmath_rows_task, &job);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define CMATH_X86_SIMD 1
+
+// Returns 2 for AVX2+FMA, 0 for scalar only. Checked once and cached.
+static int cmath_simd_level(void) {
+    static int level = -1;
+    if (level < 0) {
+        __builtin_cpu_init();
+        level = (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ? 2 : 0;
+    }
+    return level;
+}
+#endif
+
+/* Element-wise kernels and reductions
+ * Every operation works one row at a time through a row kernel (AVX2 when the
+ * CPU has it, scalar otherwise), and rows are split across threads once the
+ * matrix is big enough to amortize starting them. Reductions first reduce each
+ * row, then combine the row results in order, so the answer does not depend on
+ * the thread count. */
+// Element-wise operations on fewer elements than this run on the calling thread
+#define MATRIX_EWISE_PARALLEL (1 << 18)
+
+static int same_shape(matrix *a, matrix *b) {
+    return a->rows == b->rows && a->cols == b->cols;
+}
+
+enum { EWISE_ADD, EWISE_SUB, EWISE_MUL, EWISE_AXPY, EWISE_SCALE };
+enum { REDUCE_SUM, REDUCE_SUMSQ, REDUCE_DOT, REDUCE_MAXABS, REDUCE_MIN, REDUCE_MAX };
+
+// d = a (op) b over n elements; AXPY is a + alpha * b and SCALE is alpha * a
+static void ewise_row_scalar(int op, double alpha, double *d, const double *a, const double *b, int n) {
+    switch (op) {
+        case EWISE_ADD: for (int j = 0; j < n; j++) d[j] = a[j] + b[j]; break;
+        case EWISE_SUB: for (int j = 0; j < n; j++) d[j] = a[j] - b[j]; break;
+        case EWISE_MUL: for (int j = 0; j < n; j++) d[j] = a[j] * b[j]; break;
+        case EWISE_AXPY: for (int j = 0; j < n; j++) d[j] = a[j] + alpha * b[j]; break;
+        case EWISE_SCALE: for (int j = 0; j < n; j++) d[j] = alpha * a[j]; break;
+    }
+}
+
+static double reduce_combine(int op, double acc, double x) {
+    switch (op) {
+        case REDUCE_MAXABS: case REDUCE_MAX: return x > acc ? x : acc;
+        case REDUCE_MIN: return x < acc ? x : acc;
+        default: return acc + x;
+    }
+}
+
+static double reduce_row_scalar(int op, const double *a, const double *b, int n, double acc) {
+    switch (op) {
+        case REDUCE_SUM: for (int j = 0; j < n; j++) acc += a[j]; break;
+        case REDUCE_SUMSQ: for (int j = 0; j < n; j++) acc += a[j] * a[j]; break;
+        case REDUCE_DOT: for (int j = 0; j < n; j++) acc += a[j] * b[j]; break;
+        case REDUCE_MAXABS: for (int j = 0; j < n; j++) acc = fabs(a[j]) > acc ? fabs(a[j]) : acc; break;
+        case REDUCE_MIN: for (int j = 0; j < n; j++) acc = a[j] < acc ? a[j] : acc; break;
+        case REDUCE_MAX: for (int j = 0; j < n; j++) acc = a[j] > acc ? a[j] : acc; break;
+    }
+    return acc;
+}
+
+#ifdef CMATH_X86_SIMD
+__attribute__((target("avx2")))
+static void ewise_row_avx2(int op, double alpha, double *d, const double *a, const double *b, int n) {
+    int j = 0;
+    __m256d va = _mm256_set1_pd(alpha);
+    switch (op) {
+        case EWISE_ADD:
+            for (; j + 4 <= n; j += 4)
+                _mm256_storeu_pd(d + j, _mm256_add_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(b + j)));
+            break;
+        case EWISE_SUB:
+            for (; j + 4 <= n; j += 4)
+                _mm256_storeu_pd(d + j, _mm256_sub_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(b + j)));
+            break;
+        case EWISE_MUL:
+            for (; j + 4 <= n; j += 4)
+                _mm256_storeu_pd(d + j, _mm256_mul_pd(_mm256_loadu_pd(a + j), _mm256_loadu_pd(b + j)));
+            break;
+        case EWISE_AXPY:
+            for (; j + 4 <= n; j += 4)
+                _mm256_storeu_pd(d + j, _mm256_add_pd(_mm256_loadu_pd(a + j),
+                                                      _mm256_mul_pd(va, _mm256_loadu_pd(b + j))));
+            break;
+        case EWISE_SCALE:
+            for (; j + 4 <= n; j += 4)
+                _mm256_storeu_pd(d + j, _mm256_mul_pd(va, _mm256_loadu_pd(a + j)));
+            break;
+    }
+    ewise_row_scalar(op, alpha, d + j, a + j, b ? b + j : NULL, n - j);
+}
+
+__attribute__((target("avx2")))
+static double reduce_row_avx2(int op, const double *a, const double *b, int n, double acc) {
+    int j = 0;
+    int minmax = op == REDUCE_MAXABS || op == REDUCE_MIN || op == REDUCE_MAX;
+    // Two independent accumulators hide the add latency
+    __m256d s0 = _mm256_set1_pd(minmax ? acc : 0.0), s1 = s0;
+    __m256d sign = _mm256_set1_pd(-0.0);
+    for (; j + 8 <= n; j += 8) {
+        __m256d x0 = _mm256_loadu_pd(a + j), x1 = _mm256_loadu_pd(a + j + 4);
+        switch (op) {
+            case REDUCE_SUM: s0 = _mm256_add_pd(s0, x0); s1 = _mm256_add_pd(s1, x1); break;
+            case REDUCE_SUMSQ:
+                s0 = _mm256_add_pd(s0, _mm256_mul_pd(x0, x0));
+                s1 = _mm256_add_pd(s1, _mm256_mul_pd(x1, x1));
+                break;
+            case REDUCE_DOT:
+                s0 = _mm256_add_pd(s0, _mm256_mul_pd(x0, _mm256_loadu_pd(b + j)));
+                s1 = _mm256_add_pd(s1, _mm256_mul_pd(x1, _mm256_loadu_pd(b + j + 4)));
+                break;
+            case REDUCE_MAXABS:
+                s0 = _mm256_max_pd(s0, _mm256_andnot_pd(sign, x0));
+                s1 = _mm256_max_pd(s1, _mm256_andnot_pd(sign, x1));
+                break;
+            case REDUCE_MIN: s0 = _mm256_min_pd(s0, x0); s1 = _mm256_min_pd(s1, x1); break;
+            case REDUCE_MAX: s0 = _mm256_max_pd(s0, x0); s1 = _mm256_max_pd(s1, x1); break;
+        }
+    }
+    double lanes[8];
+    _mm256_storeu_pd(lanes, s0);
+    _mm256_storeu_pd(lanes + 4, s1);
+    if (minmax) {
+        for (int l = 0; l < 8; l++) acc = reduce_combine(op, acc, lanes[l]);
+    } else {
+        acc += ((lanes[0] + lanes[4]) + (lanes[1] + lanes[5])) + ((lanes[2] + lanes[6]) + (lanes[3] + lanes[7]));
+    }
+    return reduce_row_scalar(op, a + j, b ? b + j : NULL, n - j, acc);
+}
+#endif
+
+typedef void (*ewise_row_fn)(int op, double alpha, double *d, const double *a, const double *b, int n);
+typedef double (*reduce_row_fn)(int op, const double *a, const double *b, int n, double acc);
+
+static ewise_row_fn ewise_pick_kernel(void) {
+#ifdef CMATH_X86_SIMD
+    if (cmath_simd_level() == 2) return ewise_row_avx2;
+#endif
+    return ewise_row_scalar;
+}
+
+static reduce_row_fn reduce_pick_kernel(void) {
+#ifdef CMATH_X86_SIMD
+    if (cmath_simd_level() == 2) return reduce_row_avx2;
+#endif
+    return reduce_row_scalar;
+}
+
+static double matrix_ewise_work(matrix *m) {
+    return (double)m->rows * m->cols >= MATRIX_EWISE_PARALLEL ? CMATH_PARALLEL_WORK : 0;
+}
+
+typedef struct {
+    int op;
+    double alpha;
+    matrix *dst, *a, *b;
+} ewise_ctx;
+
+static void ewise_rows(void *p, int r0, int r1) {
+    ewise_ctx *c = (ewise_ctx*)p;
+    ewise_row_fn kernel = ewise_pick_kernel();
+    for (int i = r0; i < r1; i++)
+        kernel(c->op, c->alpha, c->dst->data[i], c->a->data[i], c->b ? c->b->data[i] : NULL, c->a->cols);
+}
+
+static matrix* matrix_ewise(int op, double alpha, matrix *dst, matrix *a, matrix *b) {
+    if (!same_shape(dst, a) || (b != NULL && !same_shape(a, b))) return NULL;
+    ewise_ctx ctx = { op, alpha, dst, a, b };
+    cmath_for_rows(a->rows, NULL, matrix_ewise_work(a), ewise_rows, &ctx);
+    return dst;
+}
+
+/* Output-parameter and in-place operations
+ * The _into functions write the result into an existing dst of the right shape
+ * and return dst (NULL on a shape mismatch), so loops can reuse one buffer
+ * instead of allocating a new matrix every iteration. dst may be a or b for
+ * element-wise operations. */
+
+matrix* matrix_add_into(matrix *dst, matrix *a, matrix *b) {
+    return matrix_ewise(EWISE_ADD, 0, dst, a, b);
+}
+
+matrix* matrix_sub_into(matrix *dst, matrix *a, matrix *b) {
+    return matrix_ewise(EWISE_SUB, 0, dst, a, b);
+}
+
+// dst = a .* b (element-wise product)
+matrix* matrix_hadamard_into(matrix *dst, matrix *a, matrix *b) {
+    return matrix_ewise(EWISE_MUL, 0, dst, a, b);
+}
+
+// a += b
+matrix* matrix_add_inplace(matrix *a, matrix *b) {
+    return matrix_add_into(a, a, b);
+}
+
+// y += alpha * x
+matrix* matrix_axpy(matrix *y, double alpha, matrix *x) {
+    return matrix_ewise(EWISE_AXPY, alpha, y, y, x);
+}
+
+// m *= alpha
+matrix* matrix_scale(matrix *m, double alpha) {
+    return matrix_ewise(EWISE_SCALE, alpha, m, m, NULL);
+}
+
 matrix* matrix_add(matrix *a, matrix *b) {
-    if (a->rows != b->rows || a->cols != b->cols) return NULL;
-    matrix *res = create_matrix(a->rows, a->cols);
-    for (int i = 0; i < a->rows; i++)
-        for (int j = 0; j < a->cols; j++)
-            res->data[i][j] = a->data[i][j] + b->data[i][j];
-    return res;
+    if (!same_shape(a, b)) return NULL;
+    return matrix_add_into(create_matrix(a->rows, a->cols), a, b);
 }
 
 matrix* matrix_sub(matrix *a, matrix *b) {
-    if (a->rows != b->rows || a->cols != b->cols) return NULL;
-    matrix *res = create_matrix(a->rows, a->cols);
-    for (int i = 0; i < a->rows; i++)
-        for (int j = 0; j < a->cols; j++)
-            res->data[i][j] = a->data[i][j] - b->data[i][j];
+    if (!same_shape(a, b)) return NULL;
+    return matrix_sub_into(create_matrix(a->rows, a->cols), a, b);
+}
+
+matrix* matrix_hadamard(matrix *a, matrix *b) {
+    if (!same_shape(a, b)) return NULL;
+    return matrix_hadamard_into(create_matrix(a->rows, a->cols), a, b);
+}
+
+typedef struct {
+    matrix *dst, *m;
+    double (*fn)(double);
+} map_ctx;
+
+static void map_rows(void *p, int r0, int r1) {
+    map_ctx *c = (map_ctx*)p;
+    for (int i = r0; i < r1; i++) {
+        const double *src = c->m->data[i];
+        double *dst = c->dst->data[i];
+        for (int j = 0; j < c->m->cols; j++) dst[j] = c->fn(src[j]);
+    }
+}
+
+// dst[i][j] = fn(m[i][j]). dst may be m.
+matrix* matrix_map_into(matrix *dst, matrix *m, double (*fn)(double)) {
+    if (!same_shape(dst, m)) return NULL;
+    map_ctx ctx = { dst, m, fn };
+    cmath_for_rows(m->rows, NULL, matrix_ewise_work(m), map_rows, &ctx);
+    return dst;
+}
+
+matrix* matrix_map(matrix *m, double (*fn)(double)) {
+    return matrix_map_into(create_matrix(m->rows, m->cols), m, fn);
+}
+
+typedef struct {
+    int op;
+    matrix *a, *b;
+    double *out;
+} reduce_ctx;
+
+static void reduce_rows(void *p, int r0, int r1) {
+    reduce_ctx *c = (reduce_ctx*)p;
+    reduce_row_fn kernel = reduce_pick_kernel();
+    for (int i = r0; i < r1; i++) {
+        const double *a = c->a->data[i];
+        double init = c->op == REDUCE_MIN || c->op == REDUCE_MAX ? a[0] : 0.0;
+        c->out[i] = kernel(c->op, a, c->b ? c->b->data[i] : NULL, c->a->cols, init);
+    }
+}
+
+// Reduces every row into out[row], then combines the rows in order
+static double matrix_reduce(int op, matrix *a, matrix *b, double *out) {
+    if (a->rows == 0 || a->cols == 0) return 0;
+    double *rows = out ? out : (double*)malloc(a->rows * sizeof(double));
+    reduce_ctx ctx = { op, a, b, rows };
+    cmath_for_rows(a->rows, NULL, matrix_ewise_work(a), reduce_rows, &ctx);
+    double acc = rows[0];
+    for (int i = 1; i < a->rows; i++) acc = reduce_combine(op, acc, rows[i]);
+    if (out == NULL) free(rows);
+    return acc;
+}
+
+double matrix_sum(matrix *m) {
+    return matrix_reduce(REDUCE_SUM, m, NULL, NULL);
+}
+
+// Frobenius norm: square root of the sum of squared elements
+double matrix_norm(matrix *m) {
+    return sqrt(matrix_reduce(REDUCE_SUMSQ, m, NULL, NULL));
+}
+
+// Largest absolute value of any element
+double matrix_max_abs(matrix *m) {
+    return matrix_reduce(REDUCE_MAXABS, m, NULL, NULL);
+}
+
+double matrix_min(matrix *m) {
+    return matrix_reduce(REDUCE_MIN, m, NULL, NULL);
+}
+
+double matrix_max(matrix *m) {
+    return matrix_reduce(REDUCE_MAX, m, NULL, NULL);
+}
+
+// Sum of a[i][j] * b[i][j]. Returns 0 (with a message) on a shape mismatch.
+double matrix_dot(matrix *a, matrix *b) {
+    if (!same_shape(a, b)) {
+        fprintf(stderr, "Error: matrix_dot shape mismatch\n");
+        return 0;
+    }
+    return matrix_reduce(REDUCE_DOT, a, b, NULL);
+}
+
+// Returns a rows x 1 matrix holding the sum of each row
+matrix* matrix_row_sums(matrix *m) {
+    matrix *res = create_matrix(m->rows, 1);
+    double *sums = (double*)malloc((m->rows > 0 ? m->rows : 1) * sizeof(double));
+    if (m->cols > 0) matrix_reduce(REDUCE_SUM, m, NULL, sums);
+    for (int i = 0; i < m->rows; i++) res->data[i][0] = m->cols > 0 ? sums[i] : 0.0;
+    free(sums);
+    return res;
+}
+
+typedef struct {
+    matrix *m;
+    double *out;
+} colsum_ctx;
+
+// Each slice owns a range of columns and walks every row, so rows are read
+// contiguously and no two threads write the same output
+static void colsum_cols(void *p, int c0, int c1) {
+    colsum_ctx *c = (colsum_ctx*)p;
+    ewise_row_fn kernel = ewise_pick_kernel();
+    for (int i = 0; i < c->m->rows; i++)
+        kernel(EWISE_ADD, 0, c->out + c0, c->out + c0, c->m->data[i] + c0, c1 - c0);
+}
+
+// Returns a 1 x cols matrix holding the sum of each column
+matrix* matrix_col_sums(matrix *m) {
+    matrix *res = create_matrix(1, m->cols);
+    colsum_ctx ctx = { m, res->data[0] };
+    cmath_for_rows(m->cols, NULL, matrix_ewise_work(m), colsum_cols, &ctx);
     return res;
 }
 
+/* Matrix multiplication (GEMM)
+ * C += alpha * A * B is computed in the usual blocked way: B is packed KC x NC at a
+ * time into NR-wide column panels (stays in L2/L3), A is packed MC x KC into
+ * MR-tall row panels (stays in L2), and a register-blocked MR x NR micro-kernel
+ * runs over the packed panels with its accumulators in registers. On x86 the
+ * AVX2/FMA micro-kernel is picked at runtime; elsewhere a scalar one is used.
+ * Large products pack each B block once and split the rows of C across threads. */
+#define GEMM_MR 4
+#define GEMM_NR 8
+#define GEMM_KC 256
+#define GEMM_MC 128
+#define GEMM_NC 2048
+// Products with fewer multiply-adds than this run on the calling thread
+#define GEMM_PARALLEL_WORK (1 << 21)
+
+// Packs an mc x kc block of A into MR-row panels, zero padding the last panel
+static void gemm_pack_a(int mc, int kc, const double *A, int lda, double *buf) {
+    for (int i = 0; i < mc; i += GEMM_MR) {
+        int mr = mc - i < GEMM_MR ? mc - i : GEMM_MR;
+        for (int p = 0; p < kc; p++) {
+            for (int r = 0; r < GEMM_MR; r++)
+                *buf++ = r < mr ? A[(size_t)(i + r) * lda + p] : 0.0;
+        }
+    }
+}
+
+// Packs a kc x nc block of B into NR-column panels, zero padding the last panel
+static void gemm_pack_b(int kc, int nc, const double *B, int ldb, double *buf) {
+    for (int j = 0; j < nc; j += GEMM_NR) {
+        int nr = nc - j < GEMM_NR ? nc - j : GEMM_NR;
+        for (int p = 0; p < kc; p++) {
+            const double *row = B + (size_t)p * ldb + j;
+            for (int c = 0; c < GEMM_NR; c++)
+                *buf++ = c < nr ? row[c] : 0.0;
+        }
+    }
+}
+
+// Adds alpha * acc to the mr x nr corner of C
+static inline void gemm_store(int mr, int nr, double alpha, const double *acc, double *C, int ldc) {
+    for (int r = 0; r < mr; r++)
+        for (int c = 0; c < nr; c++)
+            C[(size_t)r * ldc + c] += alpha * acc[r * GEMM_NR + c];
+}
+
+static void gemm_kernel_scalar(int kc, double alpha, const double *a, const double *b,
+                               double *C, int ldc, int mr, int nr) {
+    double acc[GEMM_MR * GEMM_NR] = {0};
+    for (int p = 0; p < kc; p++) {
+        for (int r = 0; r < GEMM_MR; r++) {
+            double av = a[r];
+            for (int c = 0; c < GEMM_NR; c++) acc[r * GEMM_NR + c] += av * b[c];
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    gemm_store(mr, nr, alpha, acc, C, ldc);
+}
+
+#ifdef CMATH_X86_SIMD
+__attribute__((target("avx2,fma")))
+static void gemm_kernel_avx2(int kc, double alpha, const double *a, const double *b,
+                             double *C, int ldc, int mr, int nr) {
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    for (int p = 0; p < kc; p++) {
+        __m256d b0 = _mm256_load_pd(b), b1 = _mm256_load_pd(b + 4);
+        __m256d av = _mm256_broadcast_sd(a);
+        c00 = _mm256_fmadd_pd(av, b0, c00); c01 = _mm256_fmadd_pd(av, b1, c01);
+        av = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(av, b0, c10); c11 = _mm256_fmadd_pd(av, b1, c11);
+        av = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(av, b0, c20); c21 = _mm256_fmadd_pd(av, b1, c21);
+        av = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(av, b0, c30); c31 = _mm256_fmadd_pd(av, b1, c31);
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    __m256d va = _mm256_set1_pd(alpha);
+    if (mr == GEMM_MR && nr == GEMM_NR) {
+        double *c0 = C, *c1 = C + ldc, *c2 = C + 2 * (size_t)ldc, *c3 = C + 3 * (size_t)ldc;
+        _mm256_storeu_pd(c0, _mm256_fmadd_pd(va, c00, _mm256_loadu_pd(c0)));
+        _mm256_storeu_pd(c0 + 4, _mm256_fmadd_pd(va, c01, _mm256_loadu_pd(c0 + 4)));
+        _mm256_storeu_pd(c1, _mm256_fmadd_pd(va, c10, _mm256_loadu_pd(c1)));
+        _mm256_storeu_pd(c1 + 4, _mm256_fmadd_pd(va, c11, _mm256_loadu_pd(c1 + 4)));
+        _mm256_storeu_pd(c2, _mm256_fmadd_pd(va, c20, _mm256_loadu_pd(c2)));
+        _mm256_storeu_pd(c2 + 4, _mm256_fmadd_pd(va, c21, _mm256_loadu_pd(c2 + 4)));
+        _mm256_storeu_pd(c3, _mm256_fmadd_pd(va, c30, _mm256_loadu_pd(c3)));
+        _mm256_storeu_pd(c3 + 4, _mm256_fmadd_pd(va, c31, _mm256_loadu_pd(c3 + 4)));
+        return;
+    }
+    double acc[GEMM_MR * GEMM_NR];
+    _mm256_storeu_pd(acc, c00);      _mm256_storeu_pd(acc + 4, c01);
+    _mm256_storeu_pd(acc + 8, c10);  _mm256_storeu_pd(acc + 12, c11);
+    _mm256_storeu_pd(acc + 16, c20); _mm256_storeu_pd(acc + 20, c21);
+    _mm256_storeu_pd(acc + 24, c30); _mm256_storeu_pd(acc + 28, c31);
+    gemm_store(mr, nr, alpha, acc, C, ldc);
+}
+#endif
+
+typedef void (*gemm_kernel_fn)(int kc, double alpha, const double *a, const double *b,
+                               double *C, int ldc, int mr, int nr);
+
+static gemm_kernel_fn gemm_pick_kernel(void) {
+#ifdef CMATH_X86_SIMD
+    if (cmath_simd_level() == 2) return gemm_kernel_avx2;
+#endif
+    return gemm_kernel_scalar;
+}
+
+// C += alpha * A * pb for m rows of A and C, where pb is a kc x nc block of B
+// packed by gemm_pack_b. pa is scratch for one packed MC x KC block of A.
+static void gemm_macro(gemm_kernel_fn kernel, int m, int nc, int kc, double alpha,
+                       const double *A, int lda, const double *pb, double *pa, double *C, int ldc) {
+    for (int ic = 0; ic < m; ic += GEMM_MC) {
+        int mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+        gemm_pack_a(mc, kc, A + (size_t)ic * lda, lda, pa);
+        for (int jr = 0; jr < nc; jr += GEMM_NR) {
+            int nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+            for (int ir = 0; ir < mc; ir += GEMM_MR) {
+                int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+                kernel(kc, alpha, pa + (size_t)ir * kc, pb + (size_t)jr * kc,
+                       C + (size_t)(ic + ir) * ldc + jr, ldc, mr, nr);
+            }
+        }
+    }
+}
+
+// One B block shared by every thread; each thread packs A for its own rows of C
+typedef struct {
+    gemm_kernel_fn kernel;
+    int m, nc, kc;
+    double alpha;
+    const double *A;
+    const double *pb;
+    double *pa;         // one MC x KC scratch block per thread
+    double *C;
+    int lda, ldc;
+    int threads;
+} gemm_job;
+
+static void gemm_task(void *p, int t) {
+    gemm_job *job = (gemm_job*)p;
+    // Split on MR boundaries so every thread gets whole micro-tiles
+    int tiles = job->m / GEMM_MR;
+    int r0 = (int)((long long)tiles * t / job->threads) * GEMM_MR;
+    int r1 = t == job->threads - 1 ? job->m : (int)((long long)tiles * (t + 1) / job->threads) * GEMM_MR;
+    gemm_macro(job->kernel, r1 - r0, job->nc, job->kc, job->alpha, job->A + (size_t)r0 * job->lda,
+               job->lda, job->pb, job->pa + (size_t)t * GEMM_MC * GEMM_KC,
+               job->C + (size_t)r0 * job->ldc, job->ldc);
+}
+
+// C += alpha * A * B for row-major operands with leading dimensions. Each KC x NC
+// block of B is packed once and then shared read-only while the rows of C are
+// split over the thread pool.
+static void gemm(int m, int n, int k, double alpha, const double *A, int lda,
+                 const double *B, int ldb, double *C, int ldc) {
+    if (m == 0 || n == 0 || k == 0) return;
+    int threads = matrix_thread_count();
+    if ((double)m * n * k < GEMM_PARALLEL_WORK) threads = 1;
+    if (threads > m / GEMM_MR) threads = m / GEMM_MR;
+    if (threads > CMATH_POOL_MAX) threads = CMATH_POOL_MAX;
+    if (threads < 1) threads = 1;
+    gemm_job job;
+    job.kernel = gemm_pick_kernel();
+    job.m = m;
+    job.alpha = alpha;
+    job.lda = lda;
+    job.ldc = ldc;
+    job.threads = threads;
+    job.pa = matrix_alloc_block((size_t)threads * GEMM_MC * GEMM_KC);
+    double *pb = matrix_alloc_block((size_t)GEMM_KC * GEMM_NC);
+    job.pb = pb;
+    for (int jc = 0; jc < n; jc += GEMM_NC) {
+        job.nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+        job.C = C + jc;
+        for (int pc = 0; pc < k; pc += GEMM_KC) {
+            job.kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+            job.A = A + pc;
+            gemm_pack_b(job.kc, job.nc, B + (size_t)pc * ldb + jc, ldb, pb);
+            if (threads == 1) gemm_task(&job, 0);
+            else cmath_pool_run(threads, gemm_task, &job);
+        }
+    }
+    matrix_free_block(job.pa);
+    matrix_free_block(pb);
+}
+
+// C = alpha * A * B + beta * C. c must not share storage with a or b.
+matrix* matrix_gemm(double alpha, matrix *a, matrix *b, double beta, matrix *c) {
+    if (a->cols != b->rows || c->rows != a->rows || c->cols != b->cols) return NULL;
+    if (beta == 0.0) {
+        for (int i = 0; i < c->rows; i++) memset(c->data[i], 0, c->cols * sizeof(double));
+    } else if (beta != 1.0) {
+        matrix_scale(c, beta);
+    }
+    gemm(a->rows, b->cols, a->cols, alpha, a->block, a->stride, b->block, b->stride,
+         c->block, c->stride);
+    return c;
+}
+
+// dst = a * b. dst must not share storage with a or b.
+matrix* matrix_mult_into(matrix *dst, matrix *a, matrix *b) {
+    return matrix_gemm(1.0, a, b, 0.0, dst);
+}
+
 matrix* matrix_mult(matrix *a, matrix *b) {
     if (a->cols != b->rows) return NULL;
     matrix *res = create_matrix(a->rows, b->cols);
-    for (int i = 0; i < a->rows; i++)
-        for (int j = 0; j < b->cols; j++)
-            for (int k = 0; k < a->cols; k++)
-                res->data[i][j] += a->data[i][k] * b->data[k][j];
+    gemm(a->rows, b->cols, a->cols, 1.0, a->block, a->stride, b->block, b->stride,
+         res->block, res->stride);
     return res;
 }
 
+/* Transpose
+ * Cache-oblivious: the larger dimension is halved until a block fits in
+ * TRANSPOSE_TILE x TRANSPOSE_TILE, so both the reads and the strided writes of a
+ * leaf stay in L1 at every cache level. Leaves are moved as 4x4 register
+ * transposes (AVX when available) with scalar edges. */
+#define TRANSPOSE_TILE 32
+
+typedef void (*transpose4_fn)(const double *src, int ls, double *dst, int ld);
+
+static void transpose4_scalar(const double *src, int ls, double *dst, int ld) {
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            dst[(size_t)j * ld + i] = src[(size_t)i * ls + j];
+}
+
+#ifdef CMATH_X86_SIMD
+__attribute__((target("avx")))
+static void transpose4_avx(const double *src, int ls, double *dst, int ld) {
+    __m256d r0 = _mm256_loadu_pd(src);
+    __m256d r1 = _mm256_loadu_pd(src + ls);
+    __m256d r2 = _mm256_loadu_pd(src + 2 * (size_t)ls);
+    __m256d r3 = _mm256_loadu_pd(src + 3 * (size_t)ls);
+    __m256d t0 = _mm256_unpacklo_pd(r0, r1);   // a0 b0 a2 b2
+    __m256d t1 = _mm256_unpackhi_pd(r0, r1);   // a1 b1 a3 b3
+    __m256d t2 = _mm256_unpacklo_pd(r2, r3);   // c0 d0 c2 d2
+    __m256d t3 = _mm256_unpackhi_pd(r2, r3);   // c1 d1 c3 d3
+    _mm256_storeu_pd(dst, _mm256_permute2f128_pd(t0, t2, 0x20));
+    _mm256_storeu_pd(dst + ld, _mm256_permute2f128_pd(t1, t3, 0x20));
+    _mm256_storeu_pd(dst + 2 * (size_t)ld, _mm256_permute2f128_pd(t0, t2, 0x31));
+    _mm256_storeu_pd(dst + 3 * (size_t)ld, _mm256_permute2f128_pd(t1, t3, 0x31));
+}
+#endif
+
+static transpose4_fn transpose_pick_kernel(void) {
+#ifdef CMATH_X86_SIMD
+    if (cmath_simd_level() == 2) return transpose4_avx;
+#endif
+    return transpose4_scalar;
+}
+
+static void transpose_leaf(transpose4_fn kernel, const double *src, int ls, double *dst, int ld,
+                           int rows, int cols) {
+    int r4 = rows & ~3, c4 = cols & ~3;
+    for (int i = 0; i < r4; i += 4)
+        for (int j = 0; j < c4; j += 4)
+            kernel(src + (size_t)i * ls + j, ls, dst + (size_t)j * ld + i, ld);
+    for (int i = 0; i < rows; i++)
+        for (int j = (i < r4 ? c4 : 0); j < cols; j++)
+            dst[(size_t)j * ld + i] = src[(size_t)i * ls + j];
+}
+
+// dst (cols x rows) = transpose of src (rows x cols)
+static void transpose_rec(transpose4_fn kernel, const double *src, int ls, double *dst, int ld,
+                          int rows, int cols) {
+    while (rows > TRANSPOSE_TILE || cols > TRANSPOSE_TILE) {
+        if (rows >= cols) {
+            int h = (rows / 2 + 3) & ~3;
+            transpose_rec(kernel, src, ls, dst, ld, h, cols);
+            src += (size_t)h * ls;
+            dst += h;
+            rows -= h;
+        } else {
+            int h = (cols / 2 + 3) & ~3;
+            transpose_rec(kernel, src, ls, dst, ld, rows, h);
+            src += h;
+            dst += (size_t)h * ld;
+            cols -= h;
+        }
+    }
+    transpose_leaf(kernel, src, ls, dst, ld, rows, cols);
+}
+
+// Swaps block a (rows x cols) with the transpose of block b (cols x rows); a and b are disjoint
+static void transpose_swap_rec(transpose4_fn kernel, double *a, double *b, int ld,
+                               int rows, int cols) {
+    if (rows > TRANSPOSE_TILE || cols > TRANSPOSE_TILE) {
+        if (rows >= cols) {
+            int h = (rows / 2 + 3) & ~3;
+            transpose_swap_rec(kernel, a, b, ld, h, cols);
+            transpose_swap_rec(kernel, a + (size_t)h * ld, b + h, ld, rows - h, cols);
+        } else {
+            int h = (cols / 2 + 3) & ~3;
+            transpose_swap_rec(kernel, a, b, ld, rows, h);
+            transpose_swap_rec(kernel, a + h, b + (size_t)h * ld, ld, rows, cols - h);
+        }
+        return;
+    }
+    // a is rows x cols, b is cols x rows. Stage a^T through a tile buffer, then
+    // write b^T over a and the saved a^T over b.
+    double tmp[TRANSPOSE_TILE * TRANSPOSE_TILE];
+    transpose_leaf(kernel, a, ld, tmp, TRANSPOSE_TILE, rows, cols);
+    transpose_leaf(kernel, b, ld, a, ld, cols, rows);
+    for (int j = 0; j < cols; j++)
+        memcpy(b + (size_t)j * ld, tmp + (size_t)j * TRANSPOSE_TILE, rows * sizeof(double));
+}
+
+// Transposes the n x n block at a in place
+static void transpose_square_rec(transpose4_fn kernel, double *a, int ld, int n) {
+    if (n <= TRANSPOSE_TILE) {
+        for (int i = 0; i < n; i++)
+            for (int j = i + 1; j < n; j++) {
+                double t = a[(size_t)i * ld + j];
+                a[(size_t)i * ld + j] = a[(size_t)j * ld + i];
+                a[(size_t)j * ld + i] = t;
+            }
+        return;
+    }
+    int h = (n / 2 + 3) & ~3;
+    transpose_square_rec(kernel, a, ld, h);
+    transpose_square_rec(kernel, a + (size_t)h * ld + h, ld, n - h);
+    transpose_swap_rec(kernel, a + h, a + (size_t)h * ld, ld, h, n - h);
+}
+
+// dst = transpose(m). dst must be m->cols x m->rows and must not share storage with m.
+matrix* matrix_transpose_into(matrix *dst, matrix *m) {
+    if (dst->rows != m->cols || dst->cols != m->rows) return NULL;
+    transpose_rec(transpose_pick_kernel(), m->block, m->stride, dst->block, dst->stride,
+                  m->rows, m->cols);
+    return dst;
+}
+
 matrix* matrix_transpose(matrix *m) {
-    matrix *res = create_matrix(m->cols, m->rows);
-    for (int i = 0; i < m->rows; i++)
-        for (int j = 0; j < m->cols; j++)
-            res->data[j][i] = m->data[i][j];
-    return res;
+    return matrix_transpose_into(create_matrix(m->cols, m->rows), m);
+}
+
+// Transposes a square matrix in place. Returns NULL if m is not square.
+matrix* matrix_transpose_inplace(matrix *m) {
+    if (m->rows != m->cols) return NULL;
+    transpose_square_rec(transpose_pick_kernel(), m->block, m->stride, m->rows);
+    return m;
+}
+
+/* Matrix pool
+ * Keeps released matrices so temporaries of the same shape can be reused instead
+ * of going back to malloc. Matrices from matrix_pool_get are not cleared. */
+typedef struct {
+    int count;
+    int capacity;
+    matrix **items;
+} matrix_pool;
+
+matrix_pool* create_matrix_pool(void) {
+    matrix_pool *pool = (matrix_pool*)malloc(sizeof(matrix_pool));
+    pool->count = 0;
+    pool->capacity = 0;
+    pool->items = NULL;
+    return pool;
+}
+
+// Returns a rows x cols matrix, recycled when one of that shape is available
+matrix* matrix_pool_get(matrix_pool *pool, int rows, int cols) {
+    for (int i = pool->count - 1; i >= 0; i--) {
+        matrix *m = pool->items[i];
+        if (m->rows == rows && m->cols == cols) {
+            pool->items[i] = pool->items[--pool->count];
+            return m;
+        }
+    }
+    return create_matrix(rows, cols);
+}
+
+// Hands a matrix back to the pool (views are freed instead, they own no storage).
+// If the pool cannot grow the matrix is freed and the pool is left as it was.
+void matrix_pool_put(matrix_pool *pool, matrix *m) {
+    if (m == NULL) return;
+    if (!m->owner) {
+        free_matrix(m);
+        return;
+    }
+    if (pool->count == pool->capacity) {
+        int capacity = pool->capacity ? pool->capacity * 2 : 8;
+        matrix **items = (matrix**)realloc(pool->items, capacity * sizeof(matrix*));
+        if (items == NULL) {
+            free_matrix(m);
+            return;
+        }
+        pool->items = items;
+        pool->capacity = capacity;
+    }
+    pool->items[pool->count++] = m;
+}
+
+// Frees the pool and every matrix it holds
+void free_matrix_pool(matrix_pool *pool) {
+    for (int i = 0; i < pool->count; i++) free_matrix(pool->items[i]);
+    free(pool->items);
+    free(pool);
+}
+
+/* Linear algebra
+ * LU (with partial pivoting) and Cholesky are right-looking blocked
+ * factorizations: a narrow panel of LINALG_NB columns is factored directly, and
+ * the trailing submatrix is then updated with one GEMM call, which carries
+ * almost all the flops and is itself blocked and threaded. Triangular solves
+ * are blocked the same way, so solving for many right-hand sides (or an
+ * inverse) also runs mostly inside GEMM. */
+#define LINALG_NB 64
+
+typedef struct {
+    matrix *lu;         // L (unit diagonal, below) and U (on and above the diagonal)
+    int *perm;          // row i of lu came from row perm[i] of the input
+    int sign;           // determinant sign of the permutation
+    int singular;       // 1 if a zero pivot was found
+} matrix_lu;
+
+static void linalg_swap_rows(matrix *m, int a, int b) {
+    double *ra = m->data[a], *rb = m->data[b];
+    for (int j = 0; j < m->cols; j++) {
+        double t = ra[j];
+        ra[j] = rb[j];
+        rb[j] = t;
+    }
+}
+
+// row[0..n) += alpha * x[0..n)
+static void linalg_axpy_row(double *row, double alpha, const double *x, int n) {
+    ewise_pick_kernel()(EWISE_AXPY, alpha, row, row, x, n);
+}
+
+// Solves T X = B in place (B is overwritten by X). T is n x n lower or upper
+// triangular; with unit_diag its diagonal is taken to be 1 and never read.
+static void linalg_trsm(matrix *t, matrix *b, int lower, int unit_diag) {
+    int n = t->rows, k = b->cols;
+    if (k == 0) return;
+    for (int step = 0; step < n; step += LINALG_NB) {
+        int bs = n - step < LINALG_NB ? n - step : LINALG_NB;
+        // Lower solves walk blocks top-down, upper solves bottom-up
+        int r0 = lower ? step : n - step - bs;
+        int done0 = lower ? 0 : r0 + bs, done = step;
+        if (done > 0)
+            gemm(bs, k, done, -1.0, t->data[r0] + done0, t->stride, b->data[done0], b->stride,
+                 b->data[r0], b->stride);
+        for (int s = 0; s < bs; s++) {
+            int i = lower ? r0 + s : r0 + bs - 1 - s;
+            int p0 = lower ? r0 : i + 1, p1 = lower ? i : r0 + bs;
+            for (int p = p0; p < p1; p++)
+                if (t->data[i][p] != 0) linalg_axpy_row(b->data[i], -t->data[i][p], b->data[p], k);
+            if (!unit_diag) {
+                double d = 1.0 / t->data[i][i];
+                for (int j = 0; j < k; j++) b->data[i][j] *= d;
+            }
+        }
+    }
+}
+
+// Returns X with L X = B, where L is lower triangular (unit_diag: ones on the diagonal)
+matrix* matrix_solve_lower(matrix *l, matrix *b, int unit_diag) {
+    if (l->rows != l->cols || b->rows != l->rows) return NULL;
+    matrix *x = matrix_copy(b);
+    linalg_trsm(l, x, 1, unit_diag);
+    return x;
+}
+
+// Returns X with U X = B, where U is upper triangular (unit_diag: ones on the diagonal)
+matrix* matrix_solve_upper(matrix *u, matrix *b, int unit_diag) {
+    if (u->rows != u->cols || b->rows != u->rows) return NULL;
+    matrix *x = matrix_copy(b);
+    linalg_trsm(u, x, 0, unit_diag);
+    return x;
+}
+
+void free_matrix_lu(matrix_lu *f) {
+    if (f == NULL) return;
+    free_matrix(f->lu);
+    free(f->perm);
+    free(f);
+}
+
+// Factors P A = L U for a square matrix a (a is not modified). Returns NULL if a
+// is not square. A singular matrix still factors, with f->singular set.
+matrix_lu* matrix_lu_decompose(matrix *a) {
+    if (a->rows != a->cols) return NULL;
+    int n = a->rows;
+    matrix_lu *f = (matrix_lu*)malloc(sizeof(matrix_lu));
+    f->lu = matrix_copy(a);
+    f->perm = (int*)malloc((n > 0 ? n : 1) * sizeof(int));
+    f->sign = 1;
+    f->singular = 0;
+    for (int i = 0; i < n; i++) f->perm[i] = i;
+    matrix *m = f->lu;
+    for (int k = 0; k < n; k += LINALG_NB) {
+        int kb = n - k < LINALG_NB ? n - k : LINALG_NB;
+        int end = k + kb;
+        // Panel: unblocked elimination of columns k..end over rows k..n
+        for (int j = k; j < end; j++) {
+            int p = j;
+            double best = fabs(m->data[j][j]);
+            for (int i = j + 1; i < n; i++) {
+                if (fabs(m->data[i][j]) > best) {
+                    best = fabs(m->data[i][j]);
+                    p = i;
+                }
+            }
+            if (p != j) {
+                linalg_swap_rows(m, p, j);
+                int t = f->perm[p]; f->perm[p] = f->perm[j]; f->perm[j] = t;
+                f->sign = -f->sign;
+            }
+            if (m->data[j][j] == 0) {
+                f->singular = 1;
+                continue;
+            }
+            double inv = 1.0 / m->data[j][j];
+            for (int i = j + 1; i < n; i++) {
+                double l = m->data[i][j] *= inv;
+                if (l != 0 && j + 1 < end) linalg_axpy_row(m->data[i] + j + 1, -l, m->data[j] + j + 1, end - j - 1);
+            }
+        }
+        if (end == n) break;
+        // U12 = L11^-1 A12, then A22 -= L21 U12
+        for (int i = k + 1; i < end; i++)
+            for (int p = k; p < i; p++)
+                if (m->data[i][p] != 0) linalg_axpy_row(m->data[i] + end, -m->data[i][p], m->data[p] + end, n - end);
+        gemm(n - end, n - end, kb, -1.0, m->data[end] + k, m->stride, m->data[k] + end, m->stride,
+             m->data[end] + end, m->stride);
+    }
+    return f;
+}
+
+// Returns X with A X = B from a factorization of A, or NULL if A is singular or b has the wrong height
+matrix* matrix_lu_solve(matrix_lu *f, matrix *b) {
+    int n = f->lu->rows;
+    if (f->singular || b->rows != n) return NULL;
+    matrix *x = create_matrix(n, b->cols);
+    for (int i = 0; i < n; i++) memcpy(x->data[i], b->data[f->perm[i]], b->cols * sizeof(double));
+    linalg_trsm(f->lu, x, 1, 1);
+    linalg_trsm(f->lu, x, 0, 0);
+    return x;
+}
+
+double matrix_lu_det(matrix_lu *f) {
+    if (f->singular) return 0;
+    double det = f->sign;
+    for (int i = 0; i < f->lu->rows; i++) det *= f->lu->data[i][i];
+    return det;
+}
+
+// Returns the determinant of a square matrix (0 with a message if a is not square)
+double matrix_det(matrix *a) {
+    matrix_lu *f = matrix_lu_decompose(a);
+    if (f == NULL) {
+        fprintf(stderr, "Error: determinant of a non-square matrix\n");
+        return 0;
+    }
+    double det = matrix_lu_det(f);
+    free_matrix_lu(f);
+    return det;
+}
+
+// Returns X with A X = B, or NULL if A is not square, singular or the shapes do not match
+matrix* matrix_solve(matrix *a, matrix *b) {
+    matrix_lu *f = matrix_lu_decompose(a);
+    if (f == NULL) return NULL;
+    matrix *x = matrix_lu_solve(f, b);
+    free_matrix_lu(f);
+    return x;
+}
+
+// Returns the inverse of a square matrix, or NULL if it is not square or singular
+matrix* matrix_inverse(matrix *a) {
+    if (a->rows != a->cols) return NULL;
+    matrix *id = create_matrix(a->rows, a->rows);
+    for (int i = 0; i < a->rows; i++) id->data[i][i] = 1.0;
+    matrix *inv = matrix_solve(a, id);
+    free_matrix(id);
+    return inv;
+}
+
+// Returns the lower triangular L with A = L L^T for a symmetric positive definite
+// matrix (only the lower triangle of a is read), or NULL if a is not square or
+// not positive definite.
+matrix* matrix_cholesky(matrix *a) {
+    if (a->rows != a->cols) return NULL;
+    int n = a->rows;
+    matrix *l = create_matrix(n, n);
+    for (int i = 0; i < n; i++) memcpy(l->data[i], a->data[i], (i + 1) * sizeof(double));
+    for (int k = 0; k < n; k += LINALG_NB) {
+        int kb = n - k < LINALG_NB ? n - k : LINALG_NB;
+        int end = k + kb;
+        // Diagonal block, then L21 = A21 L11^-T row by row
+        for (int i = k; i < n; i++) {
+            double *row = l->data[i];
+            int last = i < end ? i : end - 1;
+            for (int j = k; j <= last; j++) {
+                double s = row[j];
+                const double *rj = l->data[j];
+                for (int p = k; p < j; p++) s -= row[p] * rj[p];
+                if (i == j) {
+                    if (!(s > 0)) {
+                        free_matrix(l);
+                        return NULL;
+                    }
+                    row[j] = sqrt(s);
+                } else {
+                    row[j] = s / rj[j];
+                }
+            }
+        }
+        if (end == n) break;
+        // A22 -= L21 L21^T (GEMM also fills the upper triangle, which is cleared below)
+        int m = n - end;
+        matrix *l21t = create_matrix(kb, m);
+        transpose_rec(transpose_pick_kernel(), l->data[end] + k, l->stride, l21t->block, l21t->stride, m, kb);
+        gemm(m, m, kb, -1.0, l->data[end] + k, l->stride, l21t->block, l21t->stride,
+             l->data[end] + end, l->stride);
+        free_matrix(l21t);
+    }
+    for (int i = 0; i < n; i++) memset(l->data[i] + i + 1, 0, (n - i - 1) * sizeof(double));
+    return l;
+}
+
+// Returns X with A X = B given the Cholesky factor L of A
+matrix* matrix_cholesky_solve(matrix *l, matrix *b) {
+    if (l->rows != l->cols || b->rows != l->rows) return NULL;
+    matrix *x = matrix_copy(b);
+    linalg_trsm(l, x, 1, 0);
+    matrix *lt = matrix_transpose(l);
+    linalg_trsm(lt, x, 0, 0);
+    free_matrix(lt);
+    return x;
 }
 
 typedef struct {
@@ -110,6 +1282,392 @@ sparse_element* to_sparse(matrix *m, int *count) {
     return sparse;
 }
 
+/* Compressed sparse matrices
+ * CSR keeps, for every row, the column index and value of each nonzero, with
+ * ptr[i]..ptr[i+1] delimiting row i. CSC is the same layout by column. Indices
+ * inside a row (column) are sorted and unique. The CSR arrays of A are exactly
+ * the CSC arrays of A^T, so every kernel below is written once for CSR and the
+ * CSC case runs it on the transposed reading. */
+#define SPARSE_CSR 0
+#define SPARSE_CSC 1
+
+typedef struct {
+    int rows;
+    int cols;
+    int nnz;
+    int format;         // SPARSE_CSR or SPARSE_CSC
+    int *ptr;           // major + 1 offsets (rows for CSR, cols for CSC)
+    int *idx;           // minor index of each nonzero
+    double *val;
+} sparse_matrix;
+
+static int sparse_major(const sparse_matrix *s) {
+    return s->format == SPARSE_CSR ? s->rows : s->cols;
+}
+
+static int sparse_minor(const sparse_matrix *s) {
+    return s->format == SPARSE_CSR ? s->cols : s->rows;
+}
+
+// The same arrays read as the other format of the transpose (shares storage)
+static sparse_matrix sparse_as_transpose(const sparse_matrix *s) {
+    sparse_matrix t = *s;
+    t.rows = s->cols;
+    t.cols = s->rows;
+    t.format = s->format == SPARSE_CSR ? SPARSE_CSC : SPARSE_CSR;
+    return t;
+}
+
+static sparse_matrix* sparse_alloc(int rows, int cols, int nnz, int format) {
+    sparse_matrix *s = (sparse_matrix*)malloc(sizeof(sparse_matrix));
+    s->rows = rows;
+    s->cols = cols;
+    s->nnz = nnz;
+    s->format = format;
+    s->ptr = (int*)calloc((size_t)(format == SPARSE_CSR ? rows : cols) + 1, sizeof(int));
+    s->idx = (int*)malloc((nnz > 0 ? nnz : 1) * sizeof(int));
+    s->val = (double*)malloc((nnz > 0 ? nnz : 1) * sizeof(double));
+    return s;
+}
+
+void free_sparse(sparse_matrix *s) {
+    if (s == NULL) return;
+    free(s->ptr);
+    free(s->idx);
+    free(s->val);
+    free(s);
+}
+
+// Resizes idx/val to hold nnz entries
+static void sparse_set_nnz(sparse_matrix *s, int nnz) {
+    s->nnz = nnz;
+    if (nnz == 0) return;
+    s->idx = (int*)realloc(s->idx, nnz * sizeof(int));
+    s->val = (double*)realloc(s->val, nnz * sizeof(double));
+}
+
+// Builds the other layout of the same arrays: major and minor swap roles.
+// Counting sort by minor index keeps every output row sorted.
+static sparse_matrix* sparse_flip(const sparse_matrix *s, int rows, int cols, int format) {
+    int major = sparse_major(s), minor = sparse_minor(s);
+    sparse_matrix *t = sparse_alloc(rows, cols, s->nnz, format);
+    for (int k = 0; k < s->nnz; k++) t->ptr[s->idx[k] + 1]++;
+    for (int j = 0; j < minor; j++) t->ptr[j + 1] += t->ptr[j];
+    int *next = (int*)malloc((minor > 0 ? minor : 1) * sizeof(int));
+    memcpy(next, t->ptr, minor * sizeof(int));
+    for (int i = 0; i < major; i++) {
+        for (int k = s->ptr[i]; k < s->ptr[i + 1]; k++) {
+            int dst = next[s->idx[k]]++;
+            t->idx[dst] = i;
+            t->val[dst] = s->val[k];
+        }
+    }
+    free(next);
+    return t;
+}
+
+// Returns the same matrix stored as format (always a new matrix)
+sparse_matrix* sparse_convert(const sparse_matrix *s, int format) {
+    if (format == s->format) {
+        sparse_matrix *c = sparse_alloc(s->rows, s->cols, s->nnz, format);
+        memcpy(c->ptr, s->ptr, (sparse_major(s) + 1) * sizeof(int));
+        memcpy(c->idx, s->idx, s->nnz * sizeof(int));
+        memcpy(c->val, s->val, s->nnz * sizeof(double));
+        return c;
+    }
+    return sparse_flip(s, s->rows, s->cols, format);
+}
+
+// Returns the transpose, in the same format as s
+sparse_matrix* sparse_transpose(const sparse_matrix *s) {
+    return sparse_flip(s, s->cols, s->rows, s->format);
+}
+
+// Builds a sparse matrix from COO triplets (e.g. the output of to_sparse).
+// Entries may come in any order; duplicates are summed.
+sparse_matrix* sparse_from_coo(int rows, int cols, const sparse_element *coo, int count, int format) {
+    for (int k = 0; k < count; k++) {
+        if (coo[k].r < 0 || coo[k].r >= rows || coo[k].c < 0 || coo[k].c >= cols) {
+            fprintf(stderr, "Error: COO entry out of range\n");
+            return NULL;
+        }
+    }
+    // Bucket by column, then stably by row, so rows come out with sorted columns
+    int *col_ptr = (int*)calloc((size_t)cols + 1, sizeof(int));
+    int *order = (int*)malloc((count > 0 ? count : 1) * sizeof(int));
+    for (int k = 0; k < count; k++) col_ptr[coo[k].c + 1]++;
+    for (int j = 0; j < cols; j++) col_ptr[j + 1] += col_ptr[j];
+    for (int k = 0; k < count; k++) order[col_ptr[coo[k].c]++] = k;
+    free(col_ptr);
+
+    sparse_matrix *s = sparse_alloc(rows, cols, count, SPARSE_CSR);
+    for (int k = 0; k < count; k++) s->ptr[coo[k].r + 1]++;
+    for (int i = 0; i < rows; i++) s->ptr[i + 1] += s->ptr[i];
+    int *next = (int*)malloc(((size_t)rows + 1) * sizeof(int));
+    memcpy(next, s->ptr, ((size_t)rows + 1) * sizeof(int));
+    for (int n = 0; n < count; n++) {
+        const sparse_element *e = &coo[order[n]];
+        int dst = next[e->r]++;
+        s->idx[dst] = e->c;
+        s->val[dst] = e->val;
+    }
+    free(order);
+    free(next);
+
+    // Merge duplicates in place
+    int out = 0;
+    for (int i = 0; i < rows; i++) {
+        int start = s->ptr[i], end = s->ptr[i + 1];
+        s->ptr[i] = out;
+        for (int k = start; k < end; k++) {
+            if (out > s->ptr[i] && s->idx[out - 1] == s->idx[k]) {
+                s->val[out - 1] += s->val[k];
+            } else {
+                s->idx[out] = s->idx[k];
+                s->val[out++] = s->val[k];
+            }
+        }
+    }
+    s->ptr[rows] = out;
+    sparse_set_nnz(s, out);
+
+    if (format == SPARSE_CSC) {
+        sparse_matrix *c = sparse_convert(s, SPARSE_CSC);
+        free_sparse(s);
+        return c;
+    }
+    return s;
+}
+
+// Builds a sparse matrix holding the nonzero entries of m
+sparse_matrix* sparse_from_dense(matrix *m, int format) {
+    int nnz = 0;
+    for (int i = 0; i < m->rows; i++)
+        for (int j = 0; j < m->cols; j++)
+            if (m->data[i][j] != 0) nnz++;
+    sparse_matrix *s = sparse_alloc(m->rows, m->cols, nnz, SPARSE_CSR);
+    int k = 0;
+    for (int i = 0; i < m->rows; i++) {
+        for (int j = 0; j < m->cols; j++) {
+            if (m->data[i][j] != 0) {
+                s->idx[k] = j;
+                s->val[k++] = m->data[i][j];
+            }
+        }
+        s->ptr[i + 1] = k;
+    }
+    if (format == SPARSE_CSC) {
+        sparse_matrix *c = sparse_convert(s, SPARSE_CSC);
+        free_sparse(s);
+        return c;
+    }
+    return s;
+}
+
+matrix* sparse_to_dense(const sparse_matrix *s) {
+    matrix *m = create_matrix(s->rows, s->cols);
+    for (int i = 0; i < sparse_major(s); i++) {
+        for (int k = s->ptr[i]; k < s->ptr[i + 1]; k++) {
+            if (s->format == SPARSE_CSR) m->data[i][s->idx[k]] = s->val[k];
+            else m->data[s->idx[k]][i] = s->val[k];
+        }
+    }
+    return m;
+}
+
+typedef struct {
+    const sparse_matrix *a;
+    const double *x;
+    double *y;
+} spmv_ctx;
+
+static void spmv_rows(void *p, int r0, int r1) {
+    spmv_ctx *c = (spmv_ctx*)p;
+    const int *ptr = c->a->ptr, *idx = c->a->idx;
+    const double *val = c->a->val, *x = c->x;
+    for (int i = r0; i < r1; i++) {
+        double sum = 0.0;
+        for (int k = ptr[i]; k < ptr[i + 1]; k++) sum += val[k] * x[idx[k]];
+        c->y[i] = sum;
+    }
+}
+
+// y = A * x, where x has s->cols entries and y has s->rows entries. Returns y.
+double* sparse_spmv(const sparse_matrix *s, const double *x, double *y) {
+    if (s->format == SPARSE_CSC) {
+        // Column-major storage scatters into y, so it stays on one thread
+        memset(y, 0, s->rows * sizeof(double));
+        for (int j = 0; j < s->cols; j++) {
+            double xj = x[j];
+            for (int k = s->ptr[j]; k < s->ptr[j + 1]; k++) y[s->idx[k]] += s->val[k] * xj;
+        }
+        return y;
+    }
+    spmv_ctx ctx = { s, x, y };
+    cmath_for_rows(s->rows, s->ptr, s->nnz, spmv_rows, &ctx);
+    return y;
+}
+
+typedef struct {
+    const sparse_matrix *a;
+    matrix *b, *c;
+} spmm_ctx;
+
+static void spmm_rows(void *p, int r0, int r1) {
+    spmm_ctx *c = (spmm_ctx*)p;
+    int n = c->b->cols;
+    for (int i = r0; i < r1; i++) {
+        double *out = c->c->data[i];
+        for (int k = c->a->ptr[i]; k < c->a->ptr[i + 1]; k++) {
+            double v = c->a->val[k];
+            const double *row = c->b->data[c->a->idx[k]];
+            for (int j = 0; j < n; j++) out[j] += v * row[j];
+        }
+    }
+}
+
+// Returns the dense product A * B, or NULL if the dimensions do not match
+matrix* sparse_mult_dense(const sparse_matrix *a, matrix *b) {
+    if (a->cols != b->rows) return NULL;
+    sparse_matrix *csr = a->format == SPARSE_CSR ? NULL : sparse_convert(a, SPARSE_CSR);
+    matrix *res = create_matrix(a->rows, b->cols);
+    spmm_ctx ctx = { csr ? csr : a, b, res };
+    cmath_for_rows(a->rows, ctx.a->ptr, (double)a->nnz * b->cols, spmm_rows, &ctx);
+    free_sparse(csr);
+    return res;
+}
+
+/* Row-wise sparse products and sums run in two passes: a symbolic pass counts
+ * each output row so the result can be laid out exactly, then a numeric pass
+ * fills it. Both passes are split across threads by row. */
+typedef struct {
+    const sparse_matrix *a, *b;
+    sparse_matrix *c;
+} spgemm_ctx;
+
+static int sparse_cmp_int(const void *x, const void *y) {
+    int a = *(const int*)x, b = *(const int*)y;
+    return (a > b) - (a < b);
+}
+
+// Gustavson: row i of C is the sum of A[i,k] * row k of B, gathered in a dense
+// accumulator indexed by column with a marker array recording which are live
+static void spgemm_rows(spgemm_ctx *c, int r0, int r1, int numeric) {
+    const sparse_matrix *a = c->a, *b = c->b;
+    int n = b->cols;
+    int *mark = (int*)malloc((n > 0 ? n : 1) * sizeof(int));
+    double *acc = numeric ? (double*)malloc((n > 0 ? n : 1) * sizeof(double)) : NULL;
+    for (int j = 0; j < n; j++) mark[j] = -1;
+    for (int i = r0; i < r1; i++) {
+        int count = 0;
+        int *out = numeric ? c->c->idx + c->c->ptr[i] : NULL;
+        for (int ka = a->ptr[i]; ka < a->ptr[i + 1]; ka++) {
+            int row = a->idx[ka];
+            double v = a->val[ka];
+            for (int kb = b->ptr[row]; kb < b->ptr[row + 1]; kb++) {
+                int j = b->idx[kb];
+                if (mark[j] != i) {
+                    mark[j] = i;
+                    if (numeric) {
+                        out[count] = j;
+                        acc[j] = 0.0;
+                    }
+                    count++;
+                }
+                if (numeric) acc[j] += v * b->val[kb];
+            }
+        }
+        if (numeric) {
+            qsort(out, count, sizeof(int), sparse_cmp_int);
+            double *vals = c->c->val + c->c->ptr[i];
+            for (int k = 0; k < count; k++) vals[k] = acc[out[k]];
+        } else {
+            c->c->ptr[i + 1] = count;
+        }
+    }
+    free(mark);
+    free(acc);
+}
+
+static void spgemm_count(void *p, int r0, int r1) { spgemm_rows((spgemm_ctx*)p, r0, r1, 0); }
+static void spgemm_fill(void *p, int r0, int r1) { spgemm_rows((spgemm_ctx*)p, r0, r1, 1); }
+
+// Merges the sorted rows of A and B
+static void spadd_rows(spgemm_ctx *c, int r0, int r1, int numeric) {
+    const sparse_matrix *a = c->a, *b = c->b;
+    for (int i = r0; i < r1; i++) {
+        int ka = a->ptr[i], ea = a->ptr[i + 1];
+        int kb = b->ptr[i], eb = b->ptr[i + 1];
+        int out = numeric ? c->c->ptr[i] : 0;
+        while (ka < ea || kb < eb) {
+            int ja = ka < ea ? a->idx[ka] : INT_MAX;
+            int jb = kb < eb ? b->idx[kb] : INT_MAX;
+            int j = ja < jb ? ja : jb;
+            double v = 0.0;
+            if (ja == j) v += a->val[ka++];
+            if (jb == j) v += b->val[kb++];
+            if (numeric) {
+                c->c->idx[out] = j;
+                c->c->val[out] = v;
+            }
+            out++;
+        }
+        if (!numeric) c->c->ptr[i + 1] = out;
+    }
+}
+
+static void spadd_count(void *p, int r0, int r1) { spadd_rows((spgemm_ctx*)p, r0, r1, 0); }
+static void spadd_fill(void *p, int r0, int r1) { spadd_rows((spgemm_ctx*)p, r0, r1, 1); }
+
+// Runs a two-pass row kernel on CSR operands and returns the CSR result
+static sparse_matrix* sparse_two_pass(const sparse_matrix *a, const sparse_matrix *b, int cols,
+                                      double work, cmath_rows_fn count, cmath_rows_fn fill) {
+    sparse_matrix *c = sparse_alloc(a->rows, cols, 0, SPARSE_CSR);
+    spgemm_ctx ctx = { a, b, c };
+    cmath_for_rows(a->rows, a->ptr, work, count, &ctx);
+    for (int i = 0; i < a->rows; i++) c->ptr[i + 1] += c->ptr[i];
+    sparse_set_nnz(c, c->ptr[a->rows]);
+    cmath_for_rows(a->rows, a->ptr, work, fill, &ctx);
+    return c;
+}
+
+// Applies a CSR kernel to operands of either format. For CSC, C^T = B^T (op) A^T
+// is computed on the transposed readings, whose CSR result is C in CSC form.
+static sparse_matrix* sparse_binary(const sparse_matrix *a, const sparse_matrix *b, int product,
+                                    cmath_rows_fn count, cmath_rows_fn fill) {
+    sparse_matrix *conv = b->format == a->format ? NULL : sparse_convert(b, a->format);
+    const sparse_matrix *rb = conv ? conv : b;
+    sparse_matrix *res;
+    if (a->format == SPARSE_CSR) {
+        double work = product ? (double)a->nnz * rb->nnz / (rb->rows ? rb->rows : 1) : a->nnz + rb->nnz;
+        res = sparse_two_pass(a, rb, rb->cols, work, count, fill);
+    } else {
+        sparse_matrix ta = sparse_as_transpose(a), tb = sparse_as_transpose(rb);
+        const sparse_matrix *l = product ? &tb : &ta, *r = product ? &ta : &tb;
+        double work = product ? (double)l->nnz * r->nnz / (r->rows ? r->rows : 1) : l->nnz + r->nnz;
+        sparse_matrix *t = sparse_two_pass(l, r, r->cols, work, count, fill);
+        int rows = t->rows;
+        t->rows = t->cols;
+        t->cols = rows;
+        t->format = SPARSE_CSC;
+        res = t;
+    }
+    free_sparse(conv);
+    return res;
+}
+
+// Returns the sparse product A * B (in A's format), or NULL if the dimensions do not match
+sparse_matrix* sparse_mult(const sparse_matrix *a, const sparse_matrix *b) {
+    if (a->cols != b->rows) return NULL;
+    return sparse_binary(a, b, 1, spgemm_count, spgemm_fill);
+}
+
+// Returns A + B (in A's format), or NULL if the dimensions do not match
+sparse_matrix* sparse_add(const sparse_matrix *a, const sparse_matrix *b) {
+    if (a->rows != b->rows || a->cols != b->cols) return NULL;
+    return sparse_binary(a, b, 0, spadd_count, spadd_fill);
+}
+
 void matrix_print(matrix *m) {
     if (m == NULL) return;
     for (int i = 0; i < m->rows; i++) {
@@ -149,78 +1707,368 @@ double math_clamp(double val, double min, double max) {
 }
 
 
-static double apply_op(double a, double b, char op) {
-    switch (op) {
-        case '+': return a + b;
-        case '-': return a - b;
-        case '*': return a * b;
-        case '/': return a / b;
+/* Compiled expressions
+ * expr_compile parses a formula once into stack bytecode. Constant subexpressions
+ * are folded while the code is emitted, so "2*x*(3+4)" compiles the (3+4) to a single 7.
+ * Identifiers that are not functions become variables, numbered in order of
+ * first appearance; expr_eval reads their values from vars[index]. */
+enum {
+    EXPR_CONST, EXPR_VAR, EXPR_NEG,
+    EXPR_ADD, EXPR_SUB, EXPR_MUL, EXPR_DIV, EXPR_POW, EXPR_MIN, EXPR_MAX,
+    EXPR_SIN, EXPR_COS, EXPR_TAN, EXPR_SQRT, EXPR_EXP, EXPR_LOG, EXPR_ABS
+};
+
+typedef struct {
+    int code;
+    int var;            // variable index for EXPR_VAR
+    double value;       // constant for EXPR_CONST
+} expr_instr;
+
+typedef struct {
+    int count;
+    int capacity;
+    expr_instr *code;
+    int depth;          // maximum stack depth needed by expr_eval
+    int var_count;
+    char **vars;        // variable names, indexed like the vars argument of expr_eval
+} expression;
+
+static const struct {
+    const char *name;
+    int code;
+    int args;
+} expr_functions[] = {
+    { "sin", EXPR_SIN, 1 }, { "cos", EXPR_COS, 1 }, { "tan", EXPR_TAN, 1 },
+    { "sqrt", EXPR_SQRT, 1 }, { "exp", EXPR_EXP, 1 }, { "log", EXPR_LOG, 1 },
+    { "abs", EXPR_ABS, 1 }, { "min", EXPR_MIN, 2 }, { "max", EXPR_MAX, 2 },
+    { "pow", EXPR_POW, 2 }
+};
+
+static double expr_apply(int code, double a, double b) {
+    switch (code) {
+        case EXPR_NEG: return -a;
+        case EXPR_ADD: return a + b;
+        case EXPR_SUB: return a - b;
+        case EXPR_MUL: return a * b;
+        case EXPR_DIV: return a / b;
+        case EXPR_POW: return pow(a, b);
+        case EXPR_MIN: return a < b ? a : b;
+        case EXPR_MAX: return a > b ? a : b;
+        case EXPR_SIN: return sin(a);
+        case EXPR_COS: return cos(a);
+        case EXPR_TAN: return tan(a);
+        case EXPR_SQRT: return sqrt(a);
+        case EXPR_EXP: return exp(a);
+        case EXPR_LOG: return log(a);
+        case EXPR_ABS: return fabs(a);
         default: return 0;
     }
 }
 
-static int precedence(char op) {
-    if (op == '+' || op == '-') return 1;
-    if (op == '*' || op == '/') return 2;
-    return 0;
+typedef struct {
+    const char *s;
+    int pos;
+    int sp;             // stack depth after the code emitted so far
+    int error;
+    expression *e;
+} expr_parser;
+
+static void expr_push(expr_parser *p, int code, int var, double value, int pops) {
+    expression *e = p->e;
+    if (e->count == e->capacity) {
+        e->capacity = e->capacity ? e->capacity * 2 : 16;
+        e->code = (expr_instr*)realloc(e->code, e->capacity * sizeof(expr_instr));
+    }
+    expr_instr in = { code, var, value };
+    e->code[e->count++] = in;
+    p->sp += 1 - pops;
+    if (p->sp > e->depth) e->depth = p->sp;
+}
+
+// Emits an operator taking args operands, folding it when they are all constants
+static void expr_emit_op(expr_parser *p, int code, int args) {
+    expression *e = p->e;
+    int folded = e->count >= args;
+    for (int i = 1; folded && i <= args; i++)
+        folded = e->code[e->count - i].code == EXPR_CONST;
+    if (folded) {
+        double a = e->code[e->count - args].value;
+        double b = args == 2 ? e->code[e->count - 1].value : 0;
+        e->count -= args;
+        p->sp -= args;
+        expr_push(p, EXPR_CONST, 0, expr_apply(code, a, b), 0);
+        return;
+    }
+    expr_push(p, code, 0, 0, args);
 }
 
-double evaluate_expression(const char* exp) {
-    double values[100];
-    char ops[100];
-    int v_top = -1, o_top = -1;
-
-    for (int i = 0; exp[i] != '\0'; i++) {
-        if (isspace(exp[i])) continue;
-
-        if (isdigit(exp[i])) {
-            double val = 0;
-            while (i < strlen(exp) && (isdigit(exp[i]) || exp[i] == '.')) {
-                if (exp[i] == '.') {
-                    double decimal = 10;
-                    i++;
-                    while (isdigit(exp[i])) {
-                        val += (exp[i] - '0') / decimal;
-                        decimal *= 10;
-                        i++;
-                    }
+static void expr_skip(expr_parser *p) {
+    while (isspace((unsigned char)p->s[p->pos])) p->pos++;
+}
+
+static int expr_accept(expr_parser *p, char c) {
+    expr_skip(p);
+    if (p->s[p->pos] != c) return 0;
+    p->pos++;
+    return 1;
+}
+
+static void expr_fail(expr_parser *p, const char *msg) {
+    if (!p->error) fprintf(stderr, "Error: %s at position %d\n", msg, p->pos);
+    p->error = 1;
+}
+
+static void expr_parse_sum(expr_parser *p);
+static void expr_parse_unary(expr_parser *p);
+
+static int expr_var_slot(expression *e, const char *name, int len) {
+    for (int i = 0; i < e->var_count; i++)
+        if ((int)strlen(e->vars[i]) == len && strncmp(e->vars[i], name, len) == 0) return i;
+    e->vars = (char**)realloc(e->vars, (e->var_count + 1) * sizeof(char*));
+    char *copy = (char*)malloc(len + 1);
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    e->vars[e->var_count] = copy;
+    return e->var_count++;
+}
+
+// primary := number | name | name '(' args ')' | '(' sum ')'
+static void expr_parse_primary(expr_parser *p) {
+    expr_skip(p);
+    const char *c = p->s + p->pos;
+    if (isdigit((unsigned char)*c) || (*c == '.' && isdigit((unsigned char)c[1]))) {
+        char *end;
+        double val = strtod(c, &end);
+        p->pos += (int)(end - c);
+        expr_push(p, EXPR_CONST, 0, val, 0);
+    } else if (isalpha((unsigned char)*c) || *c == '_') {
+        int len = 0;
+        while (isalnum((unsigned char)c[len]) || c[len] == '_') len++;
+        p->pos += len;
+        if (!expr_accept(p, '(')) {
+            expr_push(p, EXPR_VAR, expr_var_slot(p->e, c, len), 0, 0);
+            return;
+        }
+        int f = -1;
+        for (int i = 0; i < (int)(sizeof(expr_functions) / sizeof(expr_functions[0])); i++)
+            if ((int)strlen(expr_functions[i].name) == len && strncmp(expr_functions[i].name, c, len) == 0) f = i;
+        if (f < 0) {
+            expr_fail(p, "unknown function");
+            return;
+        }
+        for (int a = 0; a < expr_functions[f].args && !p->error; a++) {
+            if (a > 0 && !expr_accept(p, ',')) expr_fail(p, "expected ','");
+            expr_parse_sum(p);
+        }
+        if (!expr_accept(p, ')')) expr_fail(p, "expected ')'");
+        expr_emit_op(p, expr_functions[f].code, expr_functions[f].args);
+    } else if (expr_accept(p, '(')) {
+        expr_parse_sum(p);
+        if (!expr_accept(p, ')')) expr_fail(p, "expected ')'");
+    } else {
+        expr_fail(p, "expected a number, name or '('");
+    }
+}
+
+// power := primary ['^' unary], right associative and binding tighter than unary minus
+static void expr_parse_power(expr_parser *p) {
+    expr_parse_primary(p);
+    if (!p->error && expr_accept(p, '^')) {
+        expr_parse_unary(p);
+        expr_emit_op(p, EXPR_POW, 2);
+    }
+}
+
+// unary := ('-' | '+') unary | power
+static void expr_parse_unary(expr_parser *p) {
+    if (expr_accept(p, '-')) {
+        expr_parse_unary(p);
+        expr_emit_op(p, EXPR_NEG, 1);
+    } else if (expr_accept(p, '+')) {
+        expr_parse_unary(p);
+    } else {
+        expr_parse_power(p);
+    }
+}
+
+// product := unary (('*' | '/') unary)*
+static void expr_parse_product(expr_parser *p) {
+    expr_parse_unary(p);
+    while (!p->error) {
+        int code;
+        if (expr_accept(p, '*')) code = EXPR_MUL;
+        else if (expr_accept(p, '/')) code = EXPR_DIV;
+        else break;
+        expr_parse_unary(p);
+        expr_emit_op(p, code, 2);
+    }
+}
+
+// sum := product (('+' | '-') product)*
+static void expr_parse_sum(expr_parser *p) {
+    expr_parse_product(p);
+    while (!p->error) {
+        int code;
+        if (expr_accept(p, '+')) code = EXPR_ADD;
+        else if (expr_accept(p, '-')) code = EXPR_SUB;
+        else break;
+        expr_parse_product(p);
+        expr_emit_op(p, code, 2);
+    }
+}
+
+void expr_free(expression *e) {
+    if (e == NULL) return;
+    for (int i = 0; i < e->var_count; i++) free(e->vars[i]);
+    free(e->vars);
+    free(e->code);
+    free(e);
+}
+
+// Compiles str into reusable bytecode. Returns NULL (with a message) on a syntax error.
+expression* expr_compile(const char *str) {
+    expression *e = (expression*)calloc(1, sizeof(expression));
+    expr_parser p = { str, 0, 0, 0, e };
+    expr_parse_sum(&p);
+    expr_skip(&p);
+    if (!p.error && str[p.pos] != '\0') expr_fail(&p, "unexpected character");
+    if (p.error) {
+        expr_free(e);
+        return NULL;
+    }
+    return e;
+}
+
+int expr_var_count(const expression *e) {
+    return e->var_count;
+}
+
+// Returns the vars[] index of the named variable, or -1 if the expression does not use it
+int expr_var_index(const expression *e, const char *name) {
+    for (int i = 0; i < e->var_count; i++)
+        if (strcmp(e->vars[i], name) == 0) return i;
+    return -1;
+}
+
+#define EXPR_STACK 64
+
+// Evaluates a compiled expression. vars holds one value per variable (may be NULL if there are none).
+double expr_eval(const expression *e, const double *vars) {
+    double local[EXPR_STACK];
+    double *stack = e->depth <= EXPR_STACK ? local : (double*)malloc(e->depth * sizeof(double));
+    int sp = -1;
+    for (int i = 0; i < e->count; i++) {
+        const expr_instr *in = &e->code[i];
+        switch (in->code) {
+            case EXPR_CONST: stack[++sp] = in->value; break;
+            case EXPR_VAR: stack[++sp] = vars[in->var]; break;
+            case EXPR_NEG: stack[sp] = -stack[sp]; break;
+            case EXPR_ADD: sp--; stack[sp] += stack[sp + 1]; break;
+            case EXPR_SUB: sp--; stack[sp] -= stack[sp + 1]; break;
+            case EXPR_MUL: sp--; stack[sp] *= stack[sp + 1]; break;
+            case EXPR_DIV: sp--; stack[sp] /= stack[sp + 1]; break;
+            case EXPR_POW: case EXPR_MIN: case EXPR_MAX:
+                sp--;
+                stack[sp] = expr_apply(in->code, stack[sp], stack[sp + 1]);
+                break;
+            default: stack[sp] = expr_apply(in->code, stack[sp], 0); break;
+        }
+    }
+    double result = sp >= 0 ? stack[sp] : 0;
+    if (stack != local) free(stack);
+    return result;
+}
+
+/* Batch evaluation
+ * Runs the bytecode one instruction at a time over blocks of EXPR_BATCH rows, so
+ * every operator becomes a tight loop the compiler can vectorize. Variables are
+ * read straight from their columns; only intermediate results are stored. */
+#define EXPR_BATCH 1024
+
+typedef struct {
+    const expression *e;
+    const double **cols;
+    double *out;
+} expr_batch_ctx;
+
+static void expr_batch_rows(void *p, int r0, int r1) {
+    expr_batch_ctx *c = (expr_batch_ctx*)p;
+    const expression *e = c->e;
+    int depth = e->depth > 0 ? e->depth : 1;
+    double *scratch = (double*)malloc((size_t)depth * EXPR_BATCH * sizeof(double));
+    const double **in = (const double**)malloc(depth * sizeof(double*));
+    for (int start = r0; start < r1; start += EXPR_BATCH) {
+        int m = r1 - start < EXPR_BATCH ? r1 - start : EXPR_BATCH;
+        int sp = -1;
+        for (int i = 0; i < e->count; i++) {
+            const expr_instr *op = &e->code[i];
+            int code = op->code;
+            if (code == EXPR_CONST) {
+                double *dst = scratch + (size_t)(++sp) * EXPR_BATCH;
+                for (int r = 0; r < m; r++) dst[r] = op->value;
+                in[sp] = dst;
+                continue;
+            }
+            if (code == EXPR_VAR) {
+                in[++sp] = c->cols[op->var] + start;
+                continue;
+            }
+            int binary = code >= EXPR_ADD && code <= EXPR_MAX;
+            if (binary) sp--;
+            const double *a = in[sp], *b = binary ? in[sp + 1] : NULL;
+            double *dst = scratch + (size_t)sp * EXPR_BATCH;
+            switch (code) {
+                case EXPR_NEG: for (int r = 0; r < m; r++) dst[r] = -a[r]; break;
+                case EXPR_ADD: for (int r = 0; r < m; r++) dst[r] = a[r] + b[r]; break;
+                case EXPR_SUB: for (int r = 0; r < m; r++) dst[r] = a[r] - b[r]; break;
+                case EXPR_MUL: for (int r = 0; r < m; r++) dst[r] = a[r] * b[r]; break;
+                case EXPR_DIV: for (int r = 0; r < m; r++) dst[r] = a[r] / b[r]; break;
+                case EXPR_MIN: for (int r = 0; r < m; r++) dst[r] = a[r] < b[r] ? a[r] : b[r]; break;
+                case EXPR_MAX: for (int r = 0; r < m; r++) dst[r] = a[r] > b[r] ? a[r] : b[r]; break;
+                case EXPR_ABS: for (int r = 0; r < m; r++) dst[r] = fabs(a[r]); break;
+                case EXPR_SQRT: for (int r = 0; r < m; r++) dst[r] = sqrt(a[r]); break;
+                default:
+                    for (int r = 0; r < m; r++) dst[r] = expr_apply(code, a[r], binary ? b[r] : 0);
                     break;
-                }
-                val = (val * 10) + (exp[i] - '0');
-                i++;
-            }
-            values[++v_top] = val;
-            i--;
-        } 
-        else if (exp[i] == '(') {
-            ops[++o_top] = '(';
-        } 
-        else if (exp[i] == ')') {
-            while (o_top != -1 && ops[o_top] != '(') {
-                double val2 = values[v_top--];
-                double val1 = values[v_top--];
-                char op = ops[o_top--];
-                values[++v_top] = apply_op(val1, val2, op);
-            }
-            o_top--; 
-        } 
-        else {
-            while (o_top != -1 && precedence(ops[o_top]) >= precedence(exp[i])) {
-                double val2 = values[v_top--];
-                double val1 = values[v_top--];
-                char op = ops[o_top--];
-                values[++v_top] = apply_op(val1, val2, op);
-            }
-            ops[++o_top] = exp[i];
-        }
-    }
-
-    while (o_top != -1) {
-        double val2 = values[v_top--];
-        double val1 = values[v_top--];
-        char op = ops[o_top--];
-        values[++v_top] = apply_op(val1, val2, op);
-    }
-
-    return values[v_top];
-}
\ No newline at end of file
+            }
+            in[sp] = dst;
+        }
+        memcpy(c->out + start, in[0], m * sizeof(double));
+    }
+    free(in);
+    free(scratch);
+}
+
+// Evaluates e for rows 0..n-1. columns[i] is a TYPE_DOUBLE array holding variable i
+// (at least n elements each). Results go to out[0..n-1]. Large batches are split
+// across the matrix thread count. Returns out, or NULL if a column is unusable.
+double* expr_eval_batch(const expression *e, array **columns, int n, double *out) {
+    const double **cols = (const double**)malloc((e->var_count > 0 ? e->var_count : 1) * sizeof(double*));
+    for (int i = 0; i < e->var_count; i++) {
+        if (columns[i] == NULL || columns[i]->type != TYPE_DOUBLE || columns[i]->size < n) {
+            fprintf(stderr, "Error: column for '%s' must be a TYPE_DOUBLE array of at least %d elements\n",
+                    e->vars[i], n);
+            free(cols);
+            return NULL;
+        }
+        cols[i] = (const double*)columns[i]->data;
+    }
+    expr_batch_ctx ctx = { e, cols, out };
+    cmath_for_rows(n, NULL, (double)n * e->count, expr_batch_rows, &ctx);
+    free(cols);
+    return out;
+}
+
+// Parses and evaluates exp in one go. Returns 0 (with a message) on a syntax error
+// or if the expression uses variables; compile once with expr_compile to reuse it.
+double evaluate_expression(const char* exp) {
+    expression *e = expr_compile(exp);
+    if (e == NULL) return 0;
+    double result = 0;
+    if (e->var_count > 0) fprintf(stderr, "Error: expression has variables, use expr_compile\n");
+    else result = expr_eval(e, NULL);
+    expr_free(e);
+    return result;
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef CRAND_H
+#define CRAND_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Random numbers
+ * xoshiro256** (Blackman and Vigna): 256 bits of state, period 2^256 - 1, and a
+ * handful of shifts, xors and small multiplies per output. An rng is plain
+ * data, so each thread can own one; rng_thread() returns a lazily seeded state
+ * private to the calling thread for code that does not pass its own. Bounded
+ * integers use Lemire's multiply-and-reject method, so every value in the
+ * range is equally likely (unlike rand() % n). */
+typedef struct {
+    uint64_t s[4];
+} rng;
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 rng_u128;
+#endif
+
+static inline uint64_t rng_rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t rng_splitmix(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Seeds r from a 64-bit value (expanded with splitmix64, so any seed is fine)
+void rng_seed(rng *r, uint64_t seed) {
+    for (int i = 0; i < 4; i++) r->s[i] = rng_splitmix(&seed);
+}
+
+// Seeds r from rand(), so output still follows srand(): the same srand seed gives
+// the same sequence, as it did when the toolkit called rand() directly
+void rng_seed_from_rand(rng *r) {
+    uint64_t seed = 0;
+    for (int i = 0; i < 4; i++) seed = seed * ((uint64_t)RAND_MAX + 1) + (uint64_t)rand();
+    rng_seed(r, seed);
+}
+
+static inline uint64_t rng_next(rng *r) {
+    uint64_t *s = r->s;
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+    return result;
+}
+
+// Uniform integer in [0, n). n must be > 0.
+static inline uint64_t rng_bounded(rng *r, uint64_t n) {
+#ifdef __SIZEOF_INT128__
+    rng_u128 m = (rng_u128)rng_next(r) * n;
+    uint64_t low = (uint64_t)m;
+    if (low < n) {
+        uint64_t threshold = (0 - n) % n;
+        while (low < threshold) {
+            m = (rng_u128)rng_next(r) * n;
+            low = (uint64_t)m;
+        }
+    }
+    return (uint64_t)(m >> 64);
+#else
+    uint64_t threshold = (0 - n) % n, x;
+    do x = rng_next(r); while (x < threshold);
+    return x % n;
+#endif
+}
+
+// Uniform integer in [min, max] (inclusive)
+static inline int rng_range(rng *r, int min, int max) {
+    if (max <= min) return min;
+    return (int)((int64_t)min + (int64_t)rng_bounded(r, (uint64_t)((int64_t)max - min) + 1));
+}
+
+// Uniform double in [0, 1) with 53 random bits
+static inline double rng_double(rng *r) {
+    return (double)(rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Advances r by 2^128 outputs, giving a non-overlapping stream (e.g. one per thread)
+void rng_jump(rng *r) {
+    static const uint64_t jump[4] = {
+        0x180EC6D33CFD0ABAULL, 0xD5A61266F0C9392CULL, 0xA9582618E03FC9AAULL, 0x39ABDC4529B1661CULL
+    };
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (jump[i] & ((uint64_t)1 << b)) {
+                s0 ^= r->s[0];
+                s1 ^= r->s[1];
+                s2 ^= r->s[2];
+                s3 ^= r->s[3];
+            }
+            rng_next(r);
+        }
+    }
+    r->s[0] = s0;
+    r->s[1] = s1;
+    r->s[2] = s2;
+    r->s[3] = s3;
+}
+
+#if defined(_MSC_VER)
+#define CRAND_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define CRAND_THREAD_LOCAL _Thread_local
+#else
+#define CRAND_THREAD_LOCAL __thread
+#endif
+
+// Returns the calling thread's generator, seeded on first use from the clock,
+// the thread's address space and a counter. Never shared between threads.
+rng* rng_thread(void) {
+    static CRAND_THREAD_LOCAL rng state;
+    static CRAND_THREAD_LOCAL int seeded = 0;
+    static uint64_t counter = 0;
+    if (!seeded) {
+#if defined(__GNUC__)
+        uint64_t n = __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+#else
+        uint64_t n = ++counter;
+#endif
+        uint64_t seed = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^ (uint64_t)(uintptr_t)&state;
+        seed ^= rng_rotl(n * 0x9E3779B97F4A7C15ULL, 31);
+        rng_seed(&state, seed);
+        seeded = 1;
+    }
+    return &state;
+}
+
+/* Bulk generation
+ * Filling runs four independent xoshiro256** lanes (seeded from r) in
+ * structure-of-arrays form. The lanes have no dependency on each other, so the
+ * inner loop maps onto 256-bit vector shifts and adds; a single rng is a serial
+ * dependency chain. Short fills just use r directly. */
+#define RNG_LANES 4
+#define RNG_CHUNK 256
+#define RNG_BULK_MIN 64
+
+typedef struct {
+    uint64_t s0[RNG_LANES], s1[RNG_LANES], s2[RNG_LANES], s3[RNG_LANES];
+} rng_lanes;
+
+static void rng_lanes_seed(rng_lanes *x, rng *r) {
+    for (int l = 0; l < RNG_LANES; l++) {
+        uint64_t seed = rng_next(r);
+        x->s0[l] = rng_splitmix(&seed);
+        x->s1[l] = rng_splitmix(&seed);
+        x->s2[l] = rng_splitmix(&seed);
+        x->s3[l] = rng_splitmix(&seed);
+    }
+}
+
+// Writes count (a multiple of RNG_LANES) raw 64-bit outputs
+static void rng_lanes_next(rng_lanes *x, uint64_t *out, int count) {
+    for (int i = 0; i < count; i += RNG_LANES) {
+        for (int l = 0; l < RNG_LANES; l++) {
+            uint64_t s1 = x->s1[l];
+            uint64_t v = (s1 << 2) + s1;                // s1 * 5
+            v = (v << 7) | (v >> 57);
+            out[i + l] = (v << 3) + v;                  // * 9
+            uint64_t t = s1 << 17;
+            x->s2[l] ^= x->s0[l];
+            x->s3[l] ^= s1;
+            x->s1[l] = s1 ^ x->s2[l];
+            x->s0[l] ^= x->s3[l];
+            x->s2[l] ^= t;
+            x->s3[l] = (x->s3[l] << 45) | (x->s3[l] >> 19);
+        }
+    }
+}
+
+// Fills out[0..n) with uniform integers in [min, max] (inclusive)
+void rng_fill_int(rng *r, int *out, size_t n, int min, int max) {
+    if (max <= min) {
+        for (size_t i = 0; i < n; i++) out[i] = min;
+        return;
+    }
+    uint64_t span = (uint64_t)((int64_t)max - min) + 1;
+    if (n < RNG_BULK_MIN) {
+        for (size_t i = 0; i < n; i++) out[i] = (int)((int64_t)min + (int64_t)rng_bounded(r, span));
+        return;
+    }
+    rng_lanes lanes;
+    uint64_t raw[RNG_CHUNK];
+    uint64_t threshold = (0 - span) % span;
+    rng_lanes_seed(&lanes, r);
+    for (size_t i = 0; i < n; i += RNG_CHUNK) {
+        size_t m = n - i < RNG_CHUNK ? n - i : RNG_CHUNK;
+        rng_lanes_next(&lanes, raw, RNG_CHUNK);
+        for (size_t k = 0; k < m; k++) {
+#ifdef __SIZEOF_INT128__
+            rng_u128 prod = (rng_u128)raw[k] * span;
+            // Rejections are rare (probability < span / 2^64); redraw those from r
+            uint64_t v = (uint64_t)prod < threshold ? rng_bounded(r, span) : (uint64_t)(prod >> 64);
+#else
+            uint64_t v = raw[k] < threshold ? rng_bounded(r, span) : raw[k] % span;
+#endif
+            out[i + k] = (int)((int64_t)min + (int64_t)v);
+        }
+    }
+}
+
+// Fills out[0..n) with uniform doubles in [min, max)
+void rng_fill_double(rng *r, double *out, size_t n, double min, double max) {
+    double scale = (max - min) * (1.0 / 9007199254740992.0);
+    if (n < RNG_BULK_MIN) {
+        for (size_t i = 0; i < n; i++) out[i] = min + (double)(rng_next(r) >> 11) * scale;
+        return;
+    }
+    rng_lanes lanes;
+    uint64_t raw[RNG_CHUNK];
+    rng_lanes_seed(&lanes, r);
+    for (size_t i = 0; i < n; i += RNG_CHUNK) {
+        size_t m = n - i < RNG_CHUNK ? n - i : RNG_CHUNK;
+        rng_lanes_next(&lanes, raw, RNG_CHUNK);
+        for (size_t k = 0; k < m; k++) out[i + k] = min + (double)(raw[k] >> 11) * scale;
+    }
+}
+
+#endif
@@ -56,31 +56,30 @@ int str_is_alpha(const char *str) {
 }
 
 
-array* str_split(const char *str, const char token) {
+// Splits the first len bytes of str at every token. str does not need to be
+// NUL-terminated, so this works directly on a cio_map_file view.
+array* str_split_n(const char *str, size_t len, const char token) {
     array *arr = create_array(0, TYPE_STRING);
-    
-    int len = strlen(str);
-    char buffer[1024];
-    int buffer_idx = 0;
-
-    for (int i = 0; i <= len; i++) {
-        if (str[i] == token || str[i] == '\0') {
-        
-            buffer[buffer_idx] = '\0';
-            char *word = strdup(buffer);
-            add_new_element(&word, arr);
-            buffer_idx = 0;
-        
-        } else {
-            if (buffer_idx < 1023) {
-                buffer[buffer_idx++] = str[i];
-            }
-        }
+    const char *end = str + len;
+    const char *start = str;
+    for (;;) {
+        const char *hit = (const char*)memchr(start, token, (size_t)(end - start));
+        const char *stop = hit ? hit : end;
+        size_t n = (size_t)(stop - start);
+        char *word = (char*)malloc(n + 1);
+        memcpy(word, start, n);
+        word[n] = '\0';
+        add_new_element(&word, arr);
+        if (!hit) break;
+        start = hit + 1;
     }
-
     return arr;
 }
 
+array* str_split(const char *str, const char token) {
+    return str_split_n(str, strlen(str), token);
+}
+
 char* str_trim(const char *str) {
     if (str == NULL) return NULL;
 
@@ -112,28 +111,52 @@ int str_contains(const char *haystack, const char *needle) {
     return strstr(haystack, needle) != NULL;
 }
 
-int str_count(const char *str, const char *sub) {
+// Counts non-overlapping occurrences of sub in the first len bytes of str
+// (str does not need to be NUL-terminated). Returns size_t because a multi-GB
+// cio_map_file view can hold more than INT_MAX matches.
+size_t str_count_n(const char *str, size_t len, const char *sub) {
     if (!str || !sub || *sub == '\0') return 0;
-    int count = 0;
-    const char *tmp = str;
-    while ((tmp = strstr(tmp, sub))) {
-        count++;
-        tmp += strlen(sub);
+    size_t sub_len = strlen(sub);
+    size_t count = 0;
+    const char *p = str, *end = str + len;
+    while ((size_t)(end - p) >= sub_len) {
+        p = (const char*)memchr(p, sub[0], (size_t)(end - p) - sub_len + 1);
+        if (!p) break;
+        if (memcmp(p, sub, sub_len) == 0) {
+            count++;
+            p += sub_len;
+        } else {
+            p++;
+        }
     }
     return count;
 }
 
-void str_shuffle(char *str) {
+int str_count(const char *str, const char *sub) {
+    if (!str) return 0;
+    return (int)str_count_n(str, strlen(str), sub);
+}
+
+// Shuffles str in place (Fisher-Yates) with r (NULL uses the calling thread's generator)
+void str_shuffle_rng(char *str, rng *r) {
     if (!str) return;
+    if (r == NULL) r = rng_thread();
     int n = strlen(str);
     for (int i = n - 1; i > 0; i--) {
-        int j = rand() % (i + 1);
+        int j = (int)rng_bounded(r, (uint64_t)i + 1);
         char temp = str[i];
         str[i] = str[j];
         str[j] = temp;
     }
 }
 
+// Seeded from rand(), so srand() still makes the output repeatable
+void str_shuffle(char *str) {
+    rng r;
+    rng_seed_from_rand(&r);
+    str_shuffle_rng(str, &r);
+}
+
 char* str_replace(const char *str, const char *old_sub, const char *new_sub) {
     char *result;
     int i, count = 0;